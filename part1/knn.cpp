@@ -2,6 +2,8 @@
 #include <vector>
 #include <chrono>
 #include <algorithm>
+#include <bit>
+#include <cstdint>
 
 // Definition of static member
 Embedding_T Node::queryEmbedding;
@@ -19,57 +21,81 @@ constexpr float getCoordinate(Embedding_T e, size_t axis)
 }
 
 
-// Build a balanced KD‐tree by splitting on median at each level.
-Node* buildKD(std::vector<std::pair<Embedding_T,int>>& items, int depth) {
-    /*
-    TODO: Implement this function to build a balanced KD-tree.
-    You should recursively construct the tree and return the root node.
-    For now, this is a stub that returns nullptr.
-    */
-
-    if (items.empty()) return nullptr;
-
-    sort(items.begin(), items.end(),
-		[](auto& a, auto& b){
-			return (a.first < b.first);
-		});
-    
+// True if two of the items in [first, last) have equal embeddings.
+static bool hasTiedEmbedding(const std::pair<Embedding_T,int>* first, const std::pair<Embedding_T,int>* last) {
+    size_t n = last - first;
+    if (n < 2) return false;
+    // open addressing over the embeddings' bit patterns, stored + 1 so 0 marks a free slot
+    thread_local std::vector<uint64_t> slots;
+    size_t mask = std::bit_ceil(2 * n) - 1;
+    slots.assign(mask + 1, 0);
+    for (auto* it = first; it != last; ++it) {
+        uint32_t bits = it->first == 0.0f ? 0 : std::bit_cast<uint32_t>(it->first);   // -0 == +0
+        uint64_t key = uint64_t(bits) + 1;
+        size_t i = (bits * 0x9E3779B97F4A7C15ull) >> 32 & mask;
+        for (; slots[i] != 0; i = (i + 1) & mask) {
+            if (slots[i] == key) return true;
+        }
+        slots[i] = key;
+    }
+    return false;
+}
 
-    int n = items.size();
 
-    int medianIndex = (n-1)/2;
-    
-    std::vector<std::pair<Embedding_T,int>> leftTree(items.begin(), items.begin()+medianIndex);
-    std::vector<std::pair<Embedding_T,int>> rightTree(items.begin()+medianIndex+1, items.end());
+// Recursive step of buildKD: fills pool[next...] with the subtree for the items
+// in [first, last) in preorder and returns its root, or nullptr for an empty subtree.
+// The tree must be the one the original builder made by std::sort-ing every range
+// and copying out the halves. With distinct embeddings the sorted order is unique
+// and the range is only partitioned around its median with nth_element. With ties,
+// where they land depends on std::sort's input order, so the range is sorted as
+// before; its halves then are in the order the original builder gave them.
+static Node* buildInto(Node* pool, size_t &next,
+                       std::pair<Embedding_T,int>* first, std::pair<Embedding_T,int>* last, int depth) {
+    if (first == last) return nullptr;
+
+    auto less = [](auto& a, auto& b){ return a.first < b.first; };
+    auto* median = first + (last - first - 1) / 2;
+    if (hasTiedEmbedding(first, last)) {
+        std::sort(first, last, less);
+    } else {
+        std::nth_element(first, median, last, less);
+    }
     
-    Node* root = new Node{items[medianIndex].first, items[medianIndex].second};
+    Node* root = &pool[next++];
+    root->embedding = median->first;
+    root->idx = median->second;
     
     //build tree
-    root->left = buildKD(leftTree, depth + 1);
-    root->right = buildKD(rightTree, depth + 1);
+    root->left = buildInto(pool, next, first, median, depth + 1);
+    root->right = buildInto(pool, next, median + 1, last, depth + 1);
     
     return root;
 }
 
 
+// Build a balanced KD‐tree by splitting on median at each level.
+// All nodes are allocated as a single block; the root owns it.
+Node* buildKD(std::vector<std::pair<Embedding_T,int>>& items, int depth) {
+    if (items.empty()) return nullptr;
+
+    Node* pool = new Node[items.size()];
+    size_t next = 0;
+    return buildInto(pool, next, items.data(), items.data() + items.size(), depth);
+}
+
+
+// The root returned by buildKD owns the whole node block.
 void freeTree(Node *node) {
-    if (!node) return;
-    freeTree(node->left);
-    freeTree(node->right);
-    delete node;
+    delete[] node;
 }
 
 
 void knnSearch(Node *node,
+               Embedding_T query,
                int depth,
                int K,
                MaxHeap &heap)
 {
-    /*
-    TODO: Implement this function to perform k-nearest neighbors (k-NN) search on the KD-tree.
-    You should recursively traverse the tree and maintain a max-heap of the K closest points found so far.
-    For now, this is a stub that does nothing.
-    */
    if (node==nullptr){
         return;
    }
@@ -77,44 +103,105 @@ void knnSearch(Node *node,
     // axis = 0 in 1d always
     int axis = 0;
 
-    //Compare the query point (Node<T>::queryEmbedding) to the current node’s point along the splitting axis.
-    if (getCoordinate(Node::queryEmbedding, axis) < getCoordinate(node->embedding, axis)){
-        knnSearch(node->left, depth+1,K, heap);
+    //Compare the query point to the current node’s point along the splitting axis.
+    if (getCoordinate(query, axis) < getCoordinate(node->embedding, axis)){
+        knnSearch(node->left, query, depth+1, K, heap);
     }
         
     else{
-        knnSearch(node->right, depth+1,K, heap);
+        knnSearch(node->right, query, depth+1, K, heap);
     }
 
     //now heap is updated w closer tree candidates
     //we check current node -- shd it be added to heap?
 
     if (heap.size()< static_cast<size_t>(K)){
-        heap.push({distance(Node::queryEmbedding, node->embedding), node->idx});
+        heap.push({distance(query, node->embedding), node->idx});
 
     }
-    else if (distance(Node::queryEmbedding, node->embedding) < heap.top().first){
+    else if (distance(query, node->embedding) < heap.top().first){
         heap.pop();
-        heap.push({distance(Node::queryEmbedding, node->embedding), node->idx});
+        heap.push({distance(query, node->embedding), node->idx});
     }
 
     //if current node is not the worst node on the heap then we can't prune 
     //because something could still beat the worst node -- explore other
     //or if we still need to add candidates
 
-    float planeDist = std::abs(getCoordinate(Node::queryEmbedding, axis)-getCoordinate(node->embedding, axis));
+    float planeDist = std::abs(getCoordinate(query, axis)-getCoordinate(node->embedding, axis));
 
     // if (heap.size()< static_cast<size_t>(K) || distance(heap.top().first, Node::queryEmbedding)> planeDist){
 
     if (heap.size()< static_cast<size_t>(K) || heap.top().first > planeDist){
 
-        if (getCoordinate(Node::queryEmbedding, axis) < getCoordinate(node->embedding, axis)){
-            knnSearch(node->right, depth+1, K,heap);
+        if (getCoordinate(query, axis) < getCoordinate(node->embedding, axis)){
+            knnSearch(node->right, query, depth+1, K, heap);
         }
         else{
-            knnSearch(node->left, depth+1, K, heap);
+            knnSearch(node->left, query, depth+1, K, heap);
         }
     }
 
     return;
-}
\ No newline at end of file
+}
+
+
+void knnSearch(Node *node,
+               int depth,
+               int K,
+               MaxHeap &heap)
+{
+    knnSearch(node, Node::queryEmbedding, depth, K, heap);
+}
+
+
+void knnSearchIterative(Node *root,
+                        Embedding_T query,
+                        int K,
+                        MaxHeap &heap)
+{
+    struct Entry
+    {
+        Node *node;
+        float planeDist;
+    };
+    // buildKD splits at the median, so a tree is at most 64 levels deep
+    Entry stack[64];
+    int sp = 0;
+
+    // axis = 0 in 1d always
+    const int axis = 0;
+
+    Node *node = root;
+    for (;;) {
+        // walk the near side down, stacking every node passed
+        while (node != nullptr) {
+            bool goLeft = getCoordinate(query, axis) < getCoordinate(node->embedding, axis);
+            Node *far = goLeft ? node->right : node->left;
+            if (far != nullptr) {
+                __builtin_prefetch(far);
+            }
+            stack[sp++] = {node, std::abs(getCoordinate(query, axis) - getCoordinate(node->embedding, axis))};
+            node = goLeft ? node->left : node->right;
+        }
+        if (sp == 0) {
+            return;
+        }
+
+        // the near side of the top entry is done: check the node itself, then its far side
+        Entry e = stack[--sp];
+        float dist = distance(query, e.node->embedding);
+        if (heap.size() < static_cast<size_t>(K)) {
+            heap.push({dist, e.node->idx});
+        }
+        else if (dist < heap.top().first) {
+            heap.pop();
+            heap.push({dist, e.node->idx});
+        }
+
+        if (heap.size() < static_cast<size_t>(K) || heap.top().first > e.planeDist) {
+            bool goLeft = getCoordinate(query, axis) < getCoordinate(e.node->embedding, axis);
+            node = goLeft ? e.node->right : e.node->left;
+        }
+    }
+}
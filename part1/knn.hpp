@@ -31,6 +31,7 @@ struct Node
  * Builds a KD-tree from a vector of items,
  * where each item consists of an embedding and its associated index.
  * The splitting dimension is chosen based on the current depth.
+ * All nodes are allocated in a single block, laid out in preorder.
  *
  * @param items A reference to a vector of pairs, each containing an embedding (Embedding_T)
  *              and an integer index.
@@ -50,6 +51,12 @@ using PQItem = std::pair<float, int>;
 
 
 
+/**
+ * Releases a KD-tree returned by buildKD.
+ * The nodes are allocated as one block owned by the root, so this is O(1).
+ *
+ * @param node The root node returned by buildKD (nullptr is allowed).
+ */
 void freeTree(Node *node);
 
 /**
@@ -62,21 +69,57 @@ void freeTree(Node *node);
 using MaxHeap = std::priority_queue<PQItem, std::vector<PQItem>, std::less<PQItem>>;
 
 
+/**
+ * @brief Performs a k-nearest neighbors (k-NN) search on a KD-tree for the given query.
+ *
+ * Reentrant: the query and the heap belong to the caller and the tree is only
+ * read, so any number of threads may search the same tree at once.
+ *
+ * @param node Pointer to the current node in the KD-tree.
+ * @param query The query embedding.
+ * @param depth Current depth in the KD-tree (used to determine splitting axis).
+ * @param K Number of nearest neighbors to search for.
+ * @param heap Reference to a max-heap that stores the current K nearest neighbors found.
+ */
+void knnSearch(Node *node,
+               Embedding_T query,
+               int depth,
+               int K,
+               MaxHeap &heap);
+
 /**
  * @brief Performs a k-nearest neighbors (k-NN) search on a KD-tree.
  *
  * This function recursively traverses the KD-tree starting from the given node,
- * searching for the K nearest neighbors to a target point. The results are maintained
- * in a max-heap, and an optional epsilon parameter can be used to allow for approximate
- * nearest neighbor search.
+ * searching for the K nearest neighbors to Node::queryEmbedding. The results are
+ * maintained in a max-heap. The search is exact.
  *
  * @param node Pointer to the current node in the KD-tree.
  * @param depth Current depth in the KD-tree (used to determine splitting axis).
  * @param K Number of nearest neighbors to search for.
- * @param epsilon Approximation factor for the search (0 for exact search).
  * @param heap Reference to a max-heap that stores the current K nearest neighbors found.
+ *
+ * A thin wrapper over the reentrant overload.
  */
  void knnSearch(Node *node,
                int depth,
                int K,
                MaxHeap &heap);
+
+/**
+ * @brief Non-recursive k-NN search, a drop-in alternative to knnSearch(root, query, 0, K, heap).
+ *
+ * Visits nodes in exactly the order of the recursive search, so the heap ends
+ * up with the same neighbors. Nodes on the way down are kept on a small fixed
+ * stack together with their plane distance, and the far child is prefetched
+ * while the near side is searched.
+ *
+ * @param root Root of a tree returned by buildKD (balanced, so the stack cannot overflow).
+ * @param query The query embedding.
+ * @param K Number of nearest neighbors to search for.
+ * @param heap Reference to a max-heap that stores the current K nearest neighbors found.
+ */
+void knnSearchIterative(Node *root,
+                        Embedding_T query,
+                        int K,
+                        MaxHeap &heap);
@@ -5,7 +5,149 @@
 
 using json = nlohmann::json;
 
-int runMain(char **argv)
+// Optional flags following the positional arguments
+struct Options
+{
+    bool batch = false;          // --batch: answer every query in the file
+    size_t maxQueries = 0;       // --max-queries N: at most N queries in batch mode, 0 = all
+    bool iterative = false;      // --iterative: search with knnSearchIterative, checked against knnSearch in batch mode
+};
+
+// Parses the flags in argv[first...]; returns false on an unknown flag.
+bool parseOptions(int argc, char **argv, int first, Options &opts)
+{
+    for (int i = first; i < argc; ++i) {
+        std::string flag = argv[i];
+        if (flag == "--batch") {
+            opts.batch = true;
+        } else if (flag == "--max-queries" && i + 1 < argc) {
+            opts.maxQueries = std::max(0, std::stoi(argv[++i]));
+            opts.batch = true;
+        } else if (flag == "--iterative") {
+            opts.iterative = true;
+        } else {
+            std::cerr << "Unknown option: " << flag << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Prints the mean and nearest-rank percentiles of per-query latencies in microseconds.
+// part1 builds on its own, so this is not shared with part2's latency.hpp.
+void printLatencySummary(std::vector<double> us)
+{
+    if (us.empty()) return;
+    std::sort(us.begin(), us.end());
+    double sum = 0;
+    for (double u : us) sum += u;
+    auto pct = [&](double p) {
+        size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * us.size()));
+        return us[std::max<size_t>(rank, 1) - 1];
+    };
+    std::cout << "Latency (us): mean " << sum / us.size()
+              << ", p50 " << pct(50) << ", p90 " << pct(90)
+              << ", p99 " << pct(99) << ", max " << us.back() << "\n";
+}
+
+// Runs the search selected by opts on one query.
+void search(Node *root, Embedding_T query, int K, const Options &opts, MaxHeap &heap)
+{
+    if (opts.iterative) {
+        knnSearchIterative(root, query, K, heap);
+    } else {
+        knnSearch(root, query, 0, K, heap);
+    }
+}
+
+// Empties a heap into a vector ordered by (distance, idx).
+std::vector<PQItem> drain(MaxHeap &heap)
+{
+    std::vector<PQItem> out(heap.size());
+    for (size_t i = out.size(); i > 0; --i) {
+        out[i - 1] = heap.top();
+        heap.pop();
+    }
+    return out;
+}
+
+/**
+ * @brief Counts the queries on which knnSearchIterative and knnSearch disagree.
+ *
+ * Both visit the nodes in the same order, so their heaps must end up with
+ * the same (distance, idx) pairs.
+ */
+size_t countIterativeMismatches(Node *root, const std::vector<Embedding_T> &queries, int K)
+{
+    size_t mismatches = 0;
+    for (Embedding_T query : queries) {
+        MaxHeap recursive, iterative;
+        knnSearch(root, query, 0, K, recursive);
+        knnSearchIterative(root, query, K, iterative);
+        if (drain(recursive) != drain(iterative)) {
+            ++mismatches;
+        }
+    }
+    return mismatches;
+}
+
+/**
+ * @brief Answers every query of the file (up to opts.maxQueries) against one tree.
+ *
+ * Prints the neighbors of each query; the caller reports throughput and latencies.
+ *
+ * @param query_json The parsed query file.
+ * @param root The root of the KD-tree built over all passages.
+ * @param K Number of nearest neighbors per query.
+ * @param opts Command line options.
+ * @param mismatches With --iterative, receives the number of queries whose
+ *                   results differ from the recursive search; 0 otherwise.
+ * @return The per-query search latencies in microseconds.
+ */
+std::vector<double> runBatch(const json &query_json, Node *root, int K, const Options &opts, size_t &mismatches)
+{
+    size_t nq = query_json.size();
+    if (opts.maxQueries > 0) {
+        nq = std::min(nq, opts.maxQueries);
+    }
+
+    // Parse all queries up front so only the searches are timed
+    std::vector<Embedding_T> queries(nq);
+    for (size_t q = 0; q < nq; ++q) {
+        queries[q] = query_json[q]["embedding"].get<float>();
+    }
+
+    std::vector<std::vector<PQItem>> results(nq);
+    std::vector<double> latencies(nq);
+    for (size_t q = 0; q < nq; ++q) {
+        auto start = std::chrono::high_resolution_clock::now();
+        MaxHeap heap;
+        search(root, queries[q], K, opts, heap);
+        std::vector<PQItem> &out = results[q];
+        while (!heap.empty()) {
+            out.push_back(heap.top());
+            heap.pop();
+        }
+        std::sort(out.begin(), out.end(),
+                  [](auto &a, auto &b) { return a.first < b.first; });
+        std::chrono::duration<double, std::micro> us = std::chrono::high_resolution_clock::now() - start;
+        latencies[q] = us.count();
+    }
+
+    for (size_t q = 0; q < nq; ++q) {
+        std::cout << "query " << q << ":\n";
+        std::cout << "  text:    " << query_json[q]["text"] << "\n";
+        for (size_t i = 0; i < results[q].size(); ++i) {
+            std::cout << "  " << (i + 1) << ". id: " << results[q][i].second
+                      << ", dist = " << results[q][i].first << "\n";
+        }
+        std::cout << "\n";
+    }
+    mismatches = opts.iterative ? countIterativeMismatches(root, queries, K) : 0;
+    return latencies;
+}
+
+int runMain(char **argv, const Options &opts)
 {
     auto program_start = std::chrono::high_resolution_clock::now();
 
@@ -49,7 +191,6 @@ int runMain(char **argv)
     // Extract the query embedding from query_json[0]
     auto query_obj = query_json[0];
     float qemb = query_obj["embedding"].get<float>();
-    Node::queryEmbedding = qemb;
 
     // Collect all passages into allPoints
     std::vector<std::pair<Embedding_T, int>> allPoints;
@@ -70,10 +211,36 @@ int runMain(char **argv)
     auto buildtree_end = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double, std::milli> buildtree_duration = buildtree_end - buildtree_start;
 
+    if (opts.batch) {
+        auto batch_start = std::chrono::high_resolution_clock::now();
+        size_t mismatches = 0;
+        std::vector<double> latencies = runBatch(query_json, root, K, opts, mismatches);
+        std::chrono::duration<double, std::milli> batch_duration =
+            std::chrono::high_resolution_clock::now() - batch_start;
+        double search_ms = 0;
+        for (double us : latencies) search_ms += us / 1000.0;
+        std::chrono::duration<double, std::milli> program_duration =
+            std::chrono::high_resolution_clock::now() - program_start;
+
+        std::cout << "#### Performance Metrics ####\n";
+        std::cout << "Elapsed time: " << program_duration.count() << " ms\n";
+        std::cout << "Processing time: " << processing_duration.count() << " ms\n";
+        std::cout << "KD-tree build time: " << buildtree_duration.count() << " ms\n";
+        std::cout << "Queries: " << latencies.size() << "\n";
+        std::cout << "Batch time: " << batch_duration.count() << " ms (search " << search_ms << " ms)\n";
+        std::cout << "Throughput: " << latencies.size() / (search_ms / 1000.0) << " QPS\n";
+        printLatencySummary(latencies);
+        if (opts.iterative) {
+            std::cout << "Iterative search mismatches: " << mismatches << " of " << latencies.size() << " queries\n";
+        }
+        freeTree(root);
+        return mismatches == 0 ? 0 : 1;
+    }
+
     // Perform K‐NN search and collect results
     auto query_start = std::chrono::high_resolution_clock::now();
     MaxHeap heap;
-    knnSearch(root, 0, K, heap);
+    search(root, qemb, K, opts, heap);
     auto query_end = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double, std::milli> query_duration = query_end - query_start;
 
@@ -128,8 +295,9 @@ int runMain(char **argv)
 
 int main(int argc, char **argv)
 {
-    if (argc != 4) {
-        std::cerr << "Usage: " << argv[0] << " <query.json> <data.json> <K>\n";
+    Options opts;
+    if (argc < 4 || !parseOptions(argc, argv, 4, opts)) {
+        std::cerr << "Usage: " << argv[0] << " <query.json> <data.json> <K> [--batch] [--max-queries N] [--iterative]\n";
         return 1;
     }
 
@@ -138,5 +306,5 @@ int main(int argc, char **argv)
     new_argv[1] = argv[2];   // pass JSON‐filename as argv[1]
     new_argv[2] = argv[3];   // pass K as argv[2]
 
-    runMain(new_argv);
+    return runMain(new_argv, opts);
 }
\ No newline at end of file
@@ -0,0 +1,90 @@
+#include "knn.hpp"
+#include <random>
+
+using json = nlohmann::json;
+using Item = std::pair<Embedding_T, int>;
+
+// Number of failed checks so far
+int failures = 0;
+
+// Records a failed check unless ok.
+void check(bool ok, const std::string &what)
+{
+    if (!ok) {
+        std::cerr << "FAIL: " << what << "\n";
+        ++failures;
+    }
+}
+
+// Loads every passage of a bundled data file.
+std::vector<Item> loadItems(const std::string &path)
+{
+    std::ifstream ifs(path);
+    json passages_json;
+    ifs >> passages_json;
+    std::vector<Item> items;
+    for (const auto &elem : passages_json) {
+        items.emplace_back(elem["embedding"].get<float>(), elem["id"].get<int>());
+    }
+    return items;
+}
+
+// n embeddings drawn from {0, ..., levels - 1}, so most of them are tied.
+std::vector<Item> tiedItems(size_t n, int levels, unsigned seed)
+{
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int> level(0, levels - 1);
+    std::vector<Item> items;
+    for (size_t i = 0; i < n; ++i) {
+        items.emplace_back(static_cast<float>(level(rng)), static_cast<int>(i));
+    }
+    return items;
+}
+
+// The original builder: sorts every range and recurses on copies of the halves.
+// Appends the idx of the tree's nodes in preorder.
+void sortingBuild(std::vector<Item> items, std::vector<int> &preorder)
+{
+    if (items.empty()) return;
+    std::sort(items.begin(), items.end(), [](auto &a, auto &b) { return a.first < b.first; });
+    int medianIndex = (static_cast<int>(items.size()) - 1) / 2;
+    preorder.push_back(items[medianIndex].second);
+    sortingBuild(std::vector<Item>(items.begin(), items.begin() + medianIndex), preorder);
+    sortingBuild(std::vector<Item>(items.begin() + medianIndex + 1, items.end()), preorder);
+}
+
+// Appends the idx of the nodes under node in preorder.
+void preorderOf(const Node *node, std::vector<int> &preorder)
+{
+    if (!node) return;
+    preorder.push_back(node->idx);
+    preorderOf(node->left, preorder);
+    preorderOf(node->right, preorder);
+}
+
+// buildKD must give the sorting builder's tree, ties included.
+void testTreeShape(const std::string &name, std::vector<Item> items)
+{
+    std::vector<int> expected, got;
+    sortingBuild(items, expected);
+    Node *root = buildKD(items, 0);
+    preorderOf(root, got);
+    freeTree(root);
+    check(got == expected, "tree shape of " + name);
+}
+
+int main()
+{
+    for (const char *path : {"data/1d-1.json", "data/1d-5.json", "data/1d-10.json", "data/1d-100.json"}) {
+        testTreeShape(path, loadItems(path));
+    }
+    testTreeShape("tied", tiedItems(3000, 20, 1));
+    testTreeShape("all equal", tiedItems(500, 1, 2));
+
+    if (failures > 0) {
+        std::cerr << failures << " check(s) failed\n";
+        return 1;
+    }
+    std::cout << "All tests passed\n";
+    return 0;
+}
@@ -0,0 +1,150 @@
+#include "knn.hpp"
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <random>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+// Leaf bucket sizes tried by the sweep
+const size_t kLeafSizes[] = {1, 2, 4, 8, 16, 32, 64};
+
+// Minimum measured time per configuration, queries are repeated until it is reached
+const double kMinQueryMs = 50.0;
+
+// Noise added to the points used as queries, as a fraction of each coordinate's standard deviation
+const double kQueryNoise = 0.25;
+
+using Clock = std::chrono::high_resolution_clock;
+
+// Loads every passage of a data file into a store; returns false if it cannot be read.
+bool loadStore(const char *path, EmbeddingStore &store)
+{
+    std::ifstream ifs(path);
+    if (!ifs) {
+        std::cerr << "Error opening data file: " << path << "\n";
+        return false;
+    }
+    json passages_json;
+    ifs >> passages_json;
+    store.reserve(passages_json.size());
+    for (const auto &elem : passages_json) {
+        readEmbedding(elem["embedding"], store.append(elem["id"].get<int>()), store.dim());
+    }
+    return true;
+}
+
+// Runs search(q, ctx) over all queries until kMinQueryMs has passed and
+// returns the mean time per query in microseconds.
+template <typename T, typename Search>
+double timeQueries(const std::vector<T> &queries, Search search)
+{
+    SearchContext ctx;
+    size_t searches = 0;
+    auto query_start = Clock::now();
+    std::chrono::duration<double, std::milli> query_ms{};
+    while (query_ms.count() < kMinQueryMs) {
+        for (const T &q : queries) {
+            search(q, ctx);
+        }
+        searches += queries.size();
+        query_ms = Clock::now() - query_start;
+    }
+    return query_ms.count() * 1000.0 / searches;
+}
+
+// Builds the tree once per leaf size and times K-NN queries near every point
+// of the dataset with the recursive and the iterative search, printing one
+// row per leaf size and the fastest one.
+template <typename T>
+void sweepLeafSizes(const char *path, int K)
+{
+    EmbeddingStore store(Embedding_T<T>::Dim());
+    if (!loadStore(path, store)) return;
+
+    // every point of the dataset, perturbed so that it is not its own nearest
+    // neighbor at distance 0 (the datasets are too small to hold queries out)
+    size_t dim = Embedding_T<T>::Dim();
+    std::vector<double> mean(dim, 0.0), sigma(dim, 0.0);
+    for (size_t r = 0; r < store.size(); ++r) {
+        for (size_t d = 0; d < dim; ++d) mean[d] += store.row(r)[d] / store.size();
+    }
+    for (size_t r = 0; r < store.size(); ++r) {
+        for (size_t d = 0; d < dim; ++d) sigma[d] += std::pow(store.row(r)[d] - mean[d], 2) / store.size();
+    }
+    std::mt19937 rng(1);
+    std::normal_distribution<double> noise;
+    std::vector<T> queries;
+    std::vector<float> row(dim);
+    for (size_t r = 0; r < store.size(); ++r) {
+        for (size_t d = 0; d < dim; ++d) {
+            row[d] = static_cast<float>(store.row(r)[d] + kQueryNoise * std::sqrt(sigma[d]) * noise(rng));
+        }
+        queries.push_back(fromRow<T>(row.data()));
+    }
+
+    std::cout << path << " (" << store.size() << " points, dim " << Embedding_T<T>::Dim()
+              << ", K " << K << ")\n";
+    std::cout << "  leaf  nodes   build ms   query us    iter us  visited\n";
+
+    size_t bestLeaf = 0;
+    double bestUs = 0;
+    for (size_t leafSize : kLeafSizes) {
+        BuildOptions build;
+        build.leafSize = leafSize;
+        auto build_start = Clock::now();
+        KDTree<T> tree = buildKDTree<T>(store, build);
+        std::chrono::duration<double, std::milli> build_ms = Clock::now() - build_start;
+
+        double us = timeQueries(queries, [&](const T &q, SearchContext &ctx) {
+            knnSearch(tree, coords(q), K, ctx);
+        });
+        double iterUs = timeQueries(queries, [&](const T &q, SearchContext &ctx) {
+            knnSearchIterative(tree, coords(q), K, ctx);
+        });
+
+        // mean nodes entered per query
+        SearchContext ctx;
+        size_t visited = 0;
+        for (const T &q : queries) {
+            knnSearch(tree, coords(q), K, ctx);
+            visited += ctx.nodesVisited;
+        }
+
+        std::cout << "  " << std::setw(4) << leafSize
+                  << std::setw(7) << tree.size()
+                  << std::setw(11) << std::fixed << std::setprecision(3) << build_ms.count()
+                  << std::setw(11) << us
+                  << std::setw(11) << iterUs
+                  << std::setw(9) << std::setprecision(1) << double(visited) / queries.size() << "\n";
+        if (bestLeaf == 0 || std::min(us, iterUs) < bestUs) {
+            bestLeaf = leafSize;
+            bestUs = std::min(us, iterUs);
+        }
+    }
+    std::cout << "  best leaf size: " << bestLeaf << "\n\n";
+}
+
+int main(int argc, char **argv)
+{
+    int K = 5;
+    int first = 1;
+    if (argc > 2 && std::string(argv[1]) == "-k") {
+        K = std::stoi(argv[2]);
+        first = 3;
+    }
+    if (argc <= first || (argc - first) % 2 != 0) {
+        std::cerr << "Usage: " << argv[0] << " [-k K] <dim> <data.json> [<dim> <data.json> ...]\n";
+        return 1;
+    }
+
+    for (int i = first; i < argc; i += 2) {
+        size_t dim = std::stoi(argv[i]);
+        runtime_dim() = dim;
+        withEmbeddingType(dim, [&](auto type) {
+            sweepLeafSizes<typename decltype(type)::type>(argv[i + 1], K);
+        });
+    }
+    return 0;
+}
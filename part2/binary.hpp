@@ -0,0 +1,141 @@
+#pragma once
+
+#include "knn.hpp"
+
+/**
+ * Sign-bit copy of an embedding store used as a prefilter: bit d of a row is
+ * set when its coordinate d is above center[d], the per-dimension mean (for
+ * centered embeddings, simply the sign). A 384-d row takes 48 bytes. The
+ * Hamming distance between bit vectors roughly tracks the angle between the
+ * vectors, so it picks candidates that are then re-ranked exactly against
+ * the store, which must outlive the index.
+ */
+template <typename T>
+struct BinaryIndex
+{
+    const EmbeddingStore *store = nullptr;
+    size_t words = 0;                   // 64-bit words per row
+    std::vector<float> center;
+    std::vector<uint64_t, AlignedAllocator<uint64_t>> bits;
+
+    size_t size() const { return store ? store->size() : 0; }
+    const uint64_t *code(size_t r) const { return bits.data() + r * words; }
+
+    // Writes the bits of x into out[0, words)
+    void encode(const float *x, uint64_t *out) const
+    {
+        std::fill(out, out + words, uint64_t(0));
+        for (size_t d = 0; d < center.size(); ++d) {
+            if (x[d] > center[d]) out[d / 64] |= uint64_t(1) << (d % 64);
+        }
+    }
+};
+
+/**
+ * Builds the sign-bit prefilter of every row of a store.
+ *
+ * @param store The embeddings; not modified, must outlive the index.
+ * @param threads Threads encoding the rows.
+ * @return The index.
+ */
+template <typename T>
+BinaryIndex<T> buildBinary(const EmbeddingStore &store, unsigned threads = 1)
+{
+    BinaryIndex<T> index;
+    index.store = &store;
+    size_t n = store.size();
+    size_t dim = store.dim();
+    index.words = (dim + 63) / 64;
+
+    std::vector<double> mean(dim, 0.0);
+    for (size_t r = 0; r < n; ++r) {
+        for (size_t d = 0; d < dim; ++d) mean[d] += store.row(r)[d];
+    }
+    index.center.resize(dim);
+    for (size_t d = 0; d < dim; ++d) {
+        index.center[d] = n > 0 ? static_cast<float>(mean[d] / n) : 0.0f;
+    }
+
+    index.bits.resize(n * index.words);
+    threads = std::max(1u, threads);
+    parallelFor(threads, [&](unsigned t) {
+        for (size_t r = n * t / threads; r < n * (t + 1) / threads; ++r) {
+            index.encode(store.row(r), index.bits.data() + r * index.words);
+        }
+    });
+    return index;
+}
+
+/**
+ * @brief k-NN search with a Hamming prefilter and exact re-ranking.
+ *
+ * Scans the bit vectors of every row with the popcount kernel `hamming`,
+ * keeps the options.rerank closest (10·K if not set, never fewer than K)
+ * and reports the K nearest of them by exact Embedding_T distance.
+ *
+ * Hamming distances are small integers with many ties, so the candidates are
+ * cut at a threshold found from a histogram of the distances instead of
+ * going through a bounded heap, whose sift steps mispredict on every tie.
+ * Rows at the threshold distance are taken in row order.
+ *
+ * @param index The sign-bit index.
+ * @param query The query, Dim() contiguous floats.
+ * @param K Number of nearest neighbors to search for.
+ * @param ctx Caller-owned context; ctx.results receives the neighbors, valid until its next search.
+ * @param options Number of candidates to re-rank.
+ */
+template <typename T>
+void knnSearch(const BinaryIndex<T> &index, const float *query, int K, SearchContext &ctx,
+               const SearchOptions &options = {})
+{
+    ctx.start(Embedding_T<T>::Dim());
+    ctx.queryBits.resize(index.words);
+    index.encode(query, ctx.queryBits.data());
+    const uint64_t *q = ctx.queryBits.data();
+    const EmbeddingStore &store = *index.store;
+    size_t n = index.size();
+    size_t candidates = std::max<size_t>(K, options.rerank > 0 ? options.rerank : 10 * static_cast<size_t>(K));
+
+    std::vector<uint32_t> &dist = ctx.rowDist;
+    std::vector<uint32_t> &histogram = ctx.histogram;
+    dist.resize(n);
+    histogram.assign(index.center.size() + 1, 0);
+    for (size_t r = 0; r < n; ++r) {
+        dist[r] = hamming(q, index.code(r), index.words);
+        ++histogram[dist[r]];
+    }
+
+    // smallest threshold with at least `candidates` rows at or below it;
+    // `atThreshold` of the rows exactly at it are taken
+    uint32_t threshold = 0;
+    size_t below = 0;
+    while (threshold + 1 < histogram.size() && below + histogram[threshold] < candidates) {
+        below += histogram[threshold++];
+    }
+    size_t atThreshold = candidates - below;
+
+    std::vector<int32_t> &rows = ctx.rowBuf;
+    rows.clear();
+    for (size_t r = 0; r < n; ++r) {
+        if (dist[r] < threshold || (dist[r] == threshold && atThreshold > 0 && atThreshold--)) {
+            rows.push_back(static_cast<int32_t>(r));
+        }
+    }
+
+    auto rerank = [&](auto &top) {
+        top.reset(K);
+        withDistanceSq<T>(store, [&](auto dist) {
+            for (int32_t r : rows) {
+                top.offer(dist(query, r), store.id(r));
+            }
+        });
+        ctx.checks += rows.size();
+        ctx.results = top.sorted();
+    };
+    if (K <= kSmallK) {
+        rerank(ctx.small);
+    }
+    else {
+        rerank(ctx.heap);
+    }
+}
@@ -0,0 +1,212 @@
+#pragma once
+
+#include "knn.hpp"
+#include <random>
+#include <numeric>
+
+/**
+ * Options of a randomized k-d forest.
+ *
+ * Each tree splits on an axis drawn at random from the topAxes dimensions
+ * with the highest variance among up to varianceSample points of the node's
+ * range, so the trees cut the data differently and one tree's bad cell is
+ * covered by another. Trees are built concurrently on up to `threads` threads.
+ */
+struct ForestOptions
+{
+    size_t trees = 4;
+    size_t leafSize = 8;
+    size_t topAxes = 5;
+    size_t varianceSample = 100;
+    uint64_t seed = 1;
+    unsigned threads = 1;
+};
+
+// Distance evaluations per query when the search options set no budget. An
+// unbounded best-bin-first search over every tree is exact but far slower than
+// the single exact tree, so the forest is always approximate.
+constexpr size_t kForestChecks = 256;
+
+// One tree of a forest: nodes in preorder like KDTree, whose rows index order
+// instead of the store, so all trees can share one unpermuted store.
+struct ForestTree
+{
+    std::vector<KDNode> nodes;
+    std::vector<int32_t> order;     // store rows in this tree's leaf order
+
+    TreeView view() const { return {nodes.data(), order.data(), nodes.empty() ? -1 : 0}; }
+};
+
+/**
+ * Randomized k-d forest over one embedding store.
+ *
+ * The store is shared by all trees and must outlive the forest. It is not
+ * permuted, so building a KDTree on the same store afterwards (which does
+ * permute it) invalidates the forest.
+ */
+template <typename T>
+struct KDForest
+{
+    const EmbeddingStore *store = nullptr;
+    std::vector<ForestTree> trees;
+    std::vector<TreeView> views;    // one per tree, for bestBinFirst
+    size_t leafSize = 1;
+
+    KDForest() = default;
+    KDForest(const KDForest &) = delete;
+    KDForest &operator=(const KDForest &) = delete;
+    KDForest(KDForest &&) = default;
+    KDForest &operator=(KDForest &&) = default;
+
+    // Total number of nodes over all trees
+    size_t size() const
+    {
+        size_t n = 0;
+        for (const ForestTree &t : trees) n += t.nodes.size();
+        return n;
+    }
+};
+
+// Picks the split axis of the rows [first, last): a random one of the
+// options.topAxes highest-variance dimensions of an evenly spaced sample.
+inline int pickSplitAxis(const EmbeddingStore &store, const int32_t *first, const int32_t *last,
+                         const ForestOptions &options, std::mt19937_64 &rng,
+                         std::vector<double> &mean, std::vector<double> &var, std::vector<int> &axes)
+{
+    size_t dim = store.dim();
+    size_t n = last - first;
+    size_t samples = std::min(n, std::max<size_t>(1, options.varianceSample));
+    mean.assign(dim, 0.0);
+    var.assign(dim, 0.0);
+    for (size_t i = 0; i < samples; ++i) {
+        const float *p = store.row(first[i * n / samples]);
+        for (size_t d = 0; d < dim; ++d) mean[d] += p[d];
+    }
+    for (size_t d = 0; d < dim; ++d) mean[d] /= samples;
+    for (size_t i = 0; i < samples; ++i) {
+        const float *p = store.row(first[i * n / samples]);
+        for (size_t d = 0; d < dim; ++d) {
+            double diff = p[d] - mean[d];
+            var[d] += diff * diff;
+        }
+    }
+
+    size_t top = std::clamp<size_t>(options.topAxes, 1, dim);
+    axes.resize(dim);
+    std::iota(axes.begin(), axes.end(), 0);
+    std::partial_sort(axes.begin(), axes.begin() + top, axes.end(),
+                      [&](int a, int b) { return var[a] > var[b] || (var[a] == var[b] && a < b); });
+    return axes[std::uniform_int_distribution<size_t>(0, top - 1)(rng)];
+}
+
+// Recursive step of buildKDForest: fills tree.nodes[slot...] with the subtree
+// over the rows [first, last) of tree.order, splitting at the median; counts
+// gives the node counts of the subtrees.
+inline void buildForestTree(const EmbeddingStore &store, ForestTree &tree, int32_t *first, int32_t *last,
+                            int32_t slot, const ForestOptions &options, const SubtreeNodeCounts &counts,
+                            std::mt19937_64 &rng, std::vector<double> &mean, std::vector<double> &var,
+                            std::vector<int> &axes)
+{
+    if (first == last) return;
+    KDNode &node = tree.nodes[slot];
+    int32_t *base = tree.order.data();
+    size_t n = last - first;
+    if (n <= options.leafSize) {
+        node.row = static_cast<int32_t>(first - base);
+        node.count = static_cast<uint16_t>(n);
+        return;
+    }
+
+    int axis = pickSplitAxis(store, first, last, options, rng, mean, var, axes);
+    int32_t *median = first + (n - 1) / 2;
+    std::nth_element(first, median, last, [axis, &store](int32_t a, int32_t b) {
+        float ca = store.row(a)[axis], cb = store.row(b)[axis];
+        return ca < cb || (ca == cb && a < b);
+    });
+
+    size_t leftSize = median - first;
+    node.row = static_cast<int32_t>(median - base);
+    node.axis = static_cast<uint16_t>(axis);
+    node.left = leftSize > 0 ? slot + 1 : -1;
+    node.right = median + 1 < last ? slot + 1 + counts(leftSize) : -1;
+
+    buildForestTree(store, tree, first, median, node.left, options, counts, rng, mean, var, axes);
+    buildForestTree(store, tree, median + 1, last, node.right, options, counts, rng, mean, var, axes);
+}
+
+/**
+ * Builds a randomized k-d forest over every row of an embedding store.
+ * Tree t is seeded with options.seed + t, so a forest is reproducible
+ * whatever the thread count.
+ *
+ * @param store The embeddings; shared by all trees, not modified.
+ * @param options Number of trees, leaf size, axis randomization and build threads.
+ * @return The forest.
+ */
+template <typename T>
+KDForest<T> buildKDForest(const EmbeddingStore &store, const ForestOptions &options = {})
+{
+    ForestOptions opts = options;
+    opts.trees = std::max<size_t>(1, opts.trees);
+    opts.leafSize = std::clamp<size_t>(opts.leafSize, 1, kMaxLeafSize);
+    unsigned threads = std::clamp<unsigned>(opts.threads, 1, static_cast<unsigned>(opts.trees));
+
+    KDForest<T> forest;
+    forest.store = &store;
+    forest.leafSize = opts.leafSize;
+    forest.trees.resize(opts.trees);
+    SubtreeNodeCounts counts(store.size(), opts.leafSize);
+
+    parallelFor(threads, [&](unsigned t) {
+        std::vector<double> mean, var;
+        std::vector<int> axes;
+        for (size_t i = t; i < opts.trees; i += threads) {
+            ForestTree &tree = forest.trees[i];
+            tree.order.resize(store.size());
+            std::iota(tree.order.begin(), tree.order.end(), 0);
+            tree.nodes.resize(counts(store.size()));
+            std::mt19937_64 rng(opts.seed + i);
+            buildForestTree(store, tree, tree.order.data(), tree.order.data() + tree.order.size(), 0,
+                            opts, counts, rng, mean, var, axes);
+        }
+    });
+
+    for (const ForestTree &tree : forest.trees) {
+        forest.views.push_back(tree.view());
+    }
+    return forest;
+}
+
+/**
+ * @brief k-NN search over all trees of a forest at once.
+ *
+ * One best-bin-first queue holds the branches of every tree, ordered by cell
+ * distance, and options.maxChecks (kForestChecks if 0) bounds the distance
+ * evaluations over the whole forest; a point found through several trees is
+ * evaluated once.
+ *
+ * @param forest The randomized k-d forest.
+ * @param query The query, Dim() contiguous floats.
+ * @param K Number of nearest neighbors to search for.
+ * @param ctx Caller-owned context; ctx.results receives the neighbors, valid until its next search.
+ * @param options eps and the shared maxChecks budget.
+ */
+template <typename T>
+void knnSearch(const KDForest<T> &forest, const float *query, int K, SearchContext &ctx,
+               const SearchOptions &options = {})
+{
+    ctx.start(Embedding_T<T>::Dim());
+    size_t checks = options.maxChecks > 0 ? options.maxChecks : kForestChecks;
+    withDistanceSq<T>(*forest.store, [&](auto dist) {
+        if (K <= kSmallK) {
+            ctx.small.reset(K);
+            bestBinFirst<T>(forest.views, *forest.store, query, options.pruneScale(), checks, ctx.small, ctx, dist);
+            ctx.results = ctx.small.sorted();
+        }
+        else {
+            ctx.heap.reset(K);
+            bestBinFirst<T>(forest.views, *forest.store, query, options.pruneScale(), checks, ctx.heap, ctx, dist);
+            ctx.results = ctx.heap.sorted();
+        }
+    });
+}
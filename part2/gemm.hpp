@@ -0,0 +1,247 @@
+#pragma once
+
+#include "knn.hpp"
+#include "linalg.h"
+
+/**
+ * Tile sizes of the blocked brute-force engine.
+ *
+ * A block of queryBlock queries is compared with rowBlock rows at a time by
+ * one matrix product; the rows of a tile (rowBlock · dim doubles) and its
+ * products (queryBlock · rowBlock doubles) should fit in L2 together; the
+ * default tile takes about 450 KB at 384 dimensions.
+ */
+struct GemmOptions
+{
+    size_t queryBlock = 64;
+    size_t rowBlock = 128;
+};
+
+/**
+ * @brief Exact search by matrix products: a double-precision copy of a store.
+ *
+ * For a block of queries Q and a tile of rows X, ALGLIB's rmatrixgemm gives
+ * all the inner products Q·Xᵀ at once, and
+ * |q - x|² = |x|² - 2·q·x + |q|² with the squared row norms kept here.
+ * ALGLIB only multiplies doubles, so the copy takes twice the memory of an
+ * fp32 store (of the widened rows if the store is half precision); the
+ * distances are rounded back to float, and near-ties may order differently
+ * from the float kernels.
+ */
+template <typename T>
+struct GemmIndex
+{
+    const EmbeddingStore *store = nullptr;
+    GemmOptions options;
+    alglib::real_2d_array rows;         // row r of the store in double precision
+    std::vector<double> normSq;         // |x|² of every row
+
+    size_t size() const { return store ? store->size() : 0; }
+};
+
+/**
+ * Copies a store for the blocked brute-force engine.
+ *
+ * @param store The embeddings; not modified, must outlive the index.
+ * @param options Tile sizes.
+ * @return The index.
+ */
+template <typename T>
+GemmIndex<T> buildGemm(const EmbeddingStore &store, const GemmOptions &options = {})
+{
+    GemmIndex<T> index;
+    index.store = &store;
+    index.options = options;
+    index.options.queryBlock = std::max<size_t>(1, options.queryBlock);
+    index.options.rowBlock = std::max<size_t>(1, options.rowBlock);
+    size_t n = store.size();
+    size_t dim = store.dim();
+    index.rows.setlength(n, dim);
+    index.normSq.resize(n);
+    for (size_t r = 0; r < n; ++r) {
+        double s = 0.0;
+        for (size_t d = 0; d < dim; ++d) {
+            double x = store.coordinate(r, d);
+            index.rows[r][d] = x;
+            s += x * x;
+        }
+        index.normSq[r] = s;
+    }
+    return index;
+}
+
+// Buffers of one thread searching a GemmIndex
+struct GemmScratch
+{
+    alglib::real_2d_array queries;      // the query block, double precision
+    alglib::real_2d_array products;     // query block x row tile inner products
+    std::vector<double> queryNormSq;
+    std::vector<SortedTopK<kSmallK>> small;
+    std::vector<TopK> heap;
+};
+
+/**
+ * Searches one block of at most options.queryBlock queries, tile by tile.
+ * Every tile's distances go straight into the per-query selections, so only
+ * one tile of products exists at a time.
+ *
+ * @param emit Callable (size_t q, std::span<const PQItem> results) receiving
+ *             the (squared distance, id) neighbors of query q of the block.
+ */
+template <typename T, typename Emit>
+void gemmSearchBlock(const GemmIndex<T> &index, const float *queries, size_t nq, int K,
+                     GemmScratch &scratch, Emit emit)
+{
+    const EmbeddingStore &store = *index.store;
+    size_t n = index.size();
+    size_t dim = store.dim();
+    size_t queryBlock = index.options.queryBlock, rowBlock = index.options.rowBlock;
+    if (scratch.queries.rows() != static_cast<alglib::ae_int_t>(queryBlock) ||
+        scratch.queries.cols() != static_cast<alglib::ae_int_t>(dim)) {
+        scratch.queries.setlength(queryBlock, dim);
+    }
+    if (scratch.products.rows() != static_cast<alglib::ae_int_t>(queryBlock) ||
+        scratch.products.cols() != static_cast<alglib::ae_int_t>(rowBlock)) {
+        scratch.products.setlength(queryBlock, rowBlock);
+    }
+    scratch.queryNormSq.resize(nq);
+    for (size_t q = 0; q < nq; ++q) {
+        double s = 0.0;
+        for (size_t d = 0; d < dim; ++d) {
+            double x = queries[q * dim + d];
+            scratch.queries[q][d] = x;
+            s += x * x;
+        }
+        scratch.queryNormSq[q] = s;
+    }
+
+    auto search = [&](auto &tops) {
+        tops.resize(std::max(tops.size(), nq));
+        for (size_t q = 0; q < nq; ++q) tops[q].reset(K);
+        for (size_t first = 0; first < n; first += rowBlock) {
+            size_t count = std::min(rowBlock, n - first);
+            // products[q][i] = query q · row first + i
+            alglib::rmatrixgemm(nq, count, dim, 1.0, scratch.queries, 0, 0, 0,
+                                index.rows, first, 0, 1, 0.0, scratch.products, 0, 0);
+            for (size_t q = 0; q < nq; ++q) {
+                auto &top = tops[q];
+                const double *products = &scratch.products[q][0];
+                double qn = scratch.queryNormSq[q];
+                for (size_t i = 0; i < count; ++i) {
+                    float d = static_cast<float>(std::max(0.0, index.normSq[first + i] - 2.0 * products[i] + qn));
+                    if (d <= top.worst()) {
+                        top.offer(d, store.id(first + i));
+                    }
+                }
+            }
+        }
+        for (size_t q = 0; q < nq; ++q) emit(q, tops[q].sorted());
+    };
+    if (K <= kSmallK) {
+        search(scratch.small);
+    }
+    else {
+        search(scratch.heap);
+    }
+}
+
+/**
+ * @brief Exact k-NN search of one query by matrix products.
+ *
+ * A block of one query, kept for the single-query path; batches should go
+ * through searchBatchGemm, which is where the blocking pays off.
+ *
+ * @param index The brute-force index.
+ * @param query The query, Dim() contiguous floats.
+ * @param K Number of nearest neighbors to search for.
+ * @param ctx Caller-owned context; ctx.results receives the neighbors, valid until its next search.
+ */
+template <typename T>
+void knnSearch(const GemmIndex<T> &index, const float *query, int K, SearchContext &ctx)
+{
+    ctx.start(Embedding_T<T>::Dim());
+    // ALGLIB matrices allocate on resize, so each thread keeps its buffers across queries
+    thread_local GemmScratch scratch;
+    ctx.checks += index.size();
+    gemmSearchBlock(index, query, 1, K, scratch, [&](size_t, std::span<const PQItem> results) {
+        ctx.beam.reset(K);
+        for (const PQItem &item : results) ctx.beam.offer(item.first, item.second);
+        ctx.results = ctx.beam.sorted();
+    });
+}
+
+/**
+ * @brief Answers a batch of queries exactly by blocked matrix products.
+ *
+ * Query blocks are handed out to the pool's workers, each with its own
+ * scratch, so a batch runs on all threads; this is also what computes the
+ * ground truth for recall measurements. A query's latency is that of its
+ * whole block, since its answer is ready only when the block is done.
+ *
+ * @param index The brute-force index.
+ * @param queries nq queries of Dim() contiguous floats each.
+ * @param nq Number of queries.
+ * @param K Number of nearest neighbors per query.
+ * @param pool Worker threads to run on.
+ * @param out Receives the results; resized to fit the batch.
+ * @param report Callable (const float *query, float key) turning a squared
+ *               distance into the distance stored in out.
+ */
+template <typename T, typename Report>
+void searchBatchGemm(const GemmIndex<T> &index, const float *queries, size_t nq, int K,
+                     WorkStealingPool &pool, BatchResults &out, Report report)
+{
+    size_t dim = Embedding_T<T>::Dim();
+    size_t queryBlock = index.options.queryBlock;
+    size_t blocks = (nq + queryBlock - 1) / queryBlock;
+    out.K = K;
+    out.items.assign(nq * K, PQItem{});
+    out.count.assign(nq, 0);
+    out.latencyUs.assign(nq, 0.0);
+
+    struct alignas(64) WorkerScratch { GemmScratch scratch; };
+    std::vector<WorkerScratch> scratch(pool.size());
+
+    pool.parallelFor(blocks, 1, [&](unsigned worker, size_t begin, size_t end) {
+        for (size_t b = begin; b < end; ++b) {
+            auto start = std::chrono::high_resolution_clock::now();
+            size_t first = b * queryBlock, count = std::min(queryBlock, nq - first);
+            const float *block = queries + first * dim;
+            gemmSearchBlock(index, block, count, K, scratch[worker].scratch,
+                            [&](size_t q, std::span<const PQItem> results) {
+                PQItem *slot = &out.items[(first + q) * K];
+                for (size_t i = 0; i < results.size(); ++i) {
+                    slot[i] = {report(block + q * dim, results[i].first), results[i].second};
+                }
+                out.count[first + q] = static_cast<int32_t>(results.size());
+            });
+            std::chrono::duration<double, std::micro> us = std::chrono::high_resolution_clock::now() - start;
+            std::fill(out.latencyUs.begin() + first, out.latencyUs.begin() + first + count, us.count());
+        }
+    });
+}
+
+/**
+ * Fraction of the true K nearest neighbors found, over a batch.
+ *
+ * @param found The results to score.
+ * @param truth Exact results for the same queries, e.g. from searchBatchGemm.
+ * @return Recall in [0, 1], 1 for an empty batch.
+ */
+inline double recallAtK(const BatchResults &found, const BatchResults &truth)
+{
+    size_t hits = 0, total = 0;
+    std::vector<int> ids;
+    for (size_t q = 0; q < truth.count.size(); ++q) {
+        const PQItem *t = truth.neighbors(q);
+        ids.clear();
+        for (int32_t i = 0; i < truth.count[q]; ++i) ids.push_back(t[i].second);
+        std::sort(ids.begin(), ids.end());
+        const PQItem *f = found.neighbors(q);
+        for (int32_t i = 0; i < found.count[q]; ++i) {
+            hits += std::binary_search(ids.begin(), ids.end(), f[i].second);
+        }
+        total += truth.count[q];
+    }
+    return total > 0 ? static_cast<double>(hits) / total : 1.0;
+}
@@ -0,0 +1,360 @@
+#pragma once
+
+#include "knn.hpp"
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <random>
+
+/**
+ * Options of a Hierarchical Navigable Small World graph (Malkov and Yashunin).
+ *
+ * Every point is linked to up to M neighbors on each of its upper levels and
+ * up to 2M on level 0. efConstruction is the beam width used to find the
+ * neighbors of a point being inserted, efSearch the default beam width of
+ * queries; larger beams raise recall at the cost of time. Points are inserted
+ * by `threads` threads at once.
+ */
+struct HnswOptions
+{
+    size_t M = 16;
+    size_t efConstruction = 200;
+    size_t efSearch = 64;
+    uint64_t seed = 100;
+    unsigned threads = 1;
+};
+
+/**
+ * HNSW graph over the rows of an embedding store, which must outlive it.
+ *
+ * Adjacency lists are stored as a count followed by a fixed number of row
+ * slots. Level 0, which every row has, is one contiguous array with a
+ * stride of 1 + maxM0 ints; the few rows reaching higher levels keep their
+ * upper lists in one block each, level by level with a stride of 1 + M.
+ */
+template <typename T>
+struct HnswGraph
+{
+    const EmbeddingStore *store = nullptr;
+    size_t M = 16;
+    size_t maxM0 = 32;
+    size_t efSearch = 64;
+    int32_t entry = -1;                      // a row on the top level
+    int maxLevel = -1;
+    std::vector<uint8_t> levels;             // top level of every row
+    std::vector<int32_t> links0;             // level 0 lists
+    std::vector<std::vector<int32_t>> upper; // per row, its lists on levels 1..levels[row]
+
+    size_t size() const { return levels.size(); }
+
+    int32_t *links(int32_t row, int level)
+    {
+        return level == 0 ? &links0[row * (1 + maxM0)] : &upper[row][(level - 1) * (1 + M)];
+    }
+    const int32_t *links(int32_t row, int level) const
+    {
+        return const_cast<HnswGraph *>(this)->links(row, level);
+    }
+};
+
+// Squared distance between a query and store row r by the search's StoreDistance, counted as a check
+template <typename T, typename Dist>
+inline float hnswDistance(const HnswGraph<T> &, const float *query, int32_t r, SearchContext &ctx, Dist dist)
+{
+    ++ctx.checks;
+    return dist(query, r);
+}
+
+// Copies the list of row on level into out; under row's lock while building
+template <typename T>
+inline void hnswReadLinks(const HnswGraph<T> &graph, int32_t row, int level, std::mutex *locks,
+                          std::vector<int32_t> &out)
+{
+    std::unique_lock<std::mutex> lock;
+    if (locks) lock = std::unique_lock<std::mutex>(locks[row]);
+    const int32_t *list = graph.links(row, level);
+    out.assign(list + 1, list + 1 + list[0]);
+}
+
+/**
+ * Greedy walk on one level: moves to the closest neighbor of the current row
+ * as long as that gets closer to the query.
+ *
+ * @param locks Per-row locks while the graph is being built, nullptr afterwards.
+ */
+template <typename T, typename Dist>
+int32_t hnswGreedy(const HnswGraph<T> &graph, const float *query, int32_t cur, float &curDist, int level,
+                   SearchContext &ctx, std::mutex *locks, std::vector<int32_t> &buf, Dist dist)
+{
+    for (bool moved = true; moved;) {
+        moved = false;
+        hnswReadLinks(graph, cur, level, locks, buf);
+        for (int32_t nb : buf) {
+            float d = hnswDistance(graph, query, nb, ctx, dist);
+            if (d < curDist) {
+                curDist = d;
+                cur = nb;
+                moved = true;
+            }
+        }
+    }
+    return cur;
+}
+
+/**
+ * Beam search on one level from a single entry row. On return ctx.beam holds
+ * the (up to) ef closest (distance, row) pairs reached.
+ *
+ * @param locks Per-row locks while the graph is being built, nullptr afterwards.
+ */
+template <typename T, typename Dist>
+void hnswSearchLayer(const HnswGraph<T> &graph, const float *query, int32_t entry, float entryDist,
+                     size_t ef, int level, SearchContext &ctx, std::mutex *locks, std::vector<int32_t> &buf,
+                     Dist dist)
+{
+    const EmbeddingStore &store = *graph.store;
+    std::vector<PQItem> &frontier = ctx.frontier;
+    ctx.beginSeen(graph.size());
+    ctx.beam.reset(static_cast<int>(ef));
+    frontier.clear();
+
+    ctx.markSeen(entry);
+    ctx.beam.offer(entryDist, entry);
+    frontier.push_back({entryDist, entry});
+
+    while (!frontier.empty()) {
+        std::pop_heap(frontier.begin(), frontier.end(), std::greater<PQItem>());
+        PQItem c = frontier.back();
+        frontier.pop_back();
+        // the closest unexpanded row is beyond the ef-th best: nothing left can improve the beam
+        if (c.first > ctx.beam.worst()) break;
+        ++ctx.nodesVisited;
+
+        hnswReadLinks(graph, c.second, level, locks, buf);
+        for (size_t i = 0; i < buf.size(); ++i) {
+            if (i + 1 < buf.size()) {
+                store.prefetch(buf[i + 1]);
+            }
+            int32_t nb = buf[i];
+            if (!ctx.markSeen(nb)) continue;
+            float d = hnswDistance(graph, query, nb, ctx, dist);
+            if (d < ctx.beam.worst()) {
+                ctx.beam.offer(d, nb);
+                frontier.push_back({d, nb});
+                std::push_heap(frontier.begin(), frontier.end(), std::greater<PQItem>());
+            }
+        }
+    }
+}
+
+/**
+ * Neighbor selection heuristic: walks the candidates from the closest and
+ * keeps one only if it is closer to the base point than to every neighbor
+ * kept so far, so links spread out in different directions.
+ *
+ * @param candidates (distance to the base point, row) pairs, ascending.
+ * @param maxLinks Most neighbors to keep.
+ * @param out Receives the kept rows.
+ */
+template <typename T, typename Dist>
+void hnswSelectNeighbors(const HnswGraph<T> &graph, std::span<const PQItem> candidates, size_t maxLinks,
+                         std::vector<int32_t> &out, Dist dist)
+{
+    const EmbeddingStore &store = *graph.store;
+    out.clear();
+    for (const PQItem &c : candidates) {
+        if (out.size() >= maxLinks) break;
+        bool keep = true;
+        for (int32_t r : out) {
+            if (dist(store.row(c.second), r) < c.first) {
+                keep = false;
+                break;
+            }
+        }
+        if (keep) out.push_back(c.second);
+    }
+}
+
+// Per-thread scratch of the graph construction
+struct HnswBuildScratch
+{
+    SearchContext ctx;
+    std::vector<int32_t> buf;
+    std::vector<PQItem> candidates;
+    std::vector<int32_t> selected;
+};
+
+// Links row into the graph on levels levels[row]..0. Holds the global lock
+// for the whole insertion when row becomes the new top, as hnswlib does.
+template <typename T, typename Dist>
+void hnswInsert(HnswGraph<T> &graph, int32_t row, const HnswOptions &options, std::mutex *locks,
+                std::mutex &globalLock, HnswBuildScratch &s, Dist dist)
+{
+    const EmbeddingStore &store = *graph.store;
+    const float *point = store.row(row);
+    int level = graph.levels[row];
+
+    std::unique_lock<std::mutex> global(globalLock);
+    int topLevel = graph.maxLevel;
+    int32_t cur = graph.entry;
+    if (level <= topLevel) {
+        global.unlock();
+    }
+
+    float curDist = hnswDistance(graph, point, cur, s.ctx, dist);
+    for (int l = topLevel; l > level; --l) {
+        cur = hnswGreedy(graph, point, cur, curDist, l, s.ctx, locks, s.buf, dist);
+    }
+
+    for (int l = std::min(level, topLevel); l >= 0; --l) {
+        hnswSearchLayer(graph, point, cur, curDist, options.efConstruction, l, s.ctx, locks, s.buf, dist);
+        std::span<const PQItem> found = s.ctx.beam.sorted();
+        s.candidates.assign(found.begin(), found.end());
+        hnswSelectNeighbors(graph, s.candidates, graph.M, s.selected, dist);
+
+        {
+            std::lock_guard<std::mutex> lock(locks[row]);
+            int32_t *list = graph.links(row, l);
+            list[0] = static_cast<int32_t>(s.selected.size());
+            std::copy(s.selected.begin(), s.selected.end(), list + 1);
+        }
+
+        // link back; a full list keeps the heuristic's pick among its old neighbors and row
+        size_t cap = l == 0 ? graph.maxM0 : graph.M;
+        for (int32_t nb : s.selected) {
+            std::lock_guard<std::mutex> lock(locks[nb]);
+            int32_t *list = graph.links(nb, l);
+            if (static_cast<size_t>(list[0]) < cap) {
+                list[1 + list[0]++] = row;
+                continue;
+            }
+            const float *base = store.row(nb);
+            std::vector<PQItem> &pool = s.ctx.frontier;
+            pool.clear();
+            for (int32_t i = 1; i <= list[0]; ++i) {
+                pool.push_back({dist(base, list[i]), list[i]});
+            }
+            pool.push_back({dist(base, row), row});
+            std::sort(pool.begin(), pool.end());
+            hnswSelectNeighbors(graph, pool, cap, s.buf, dist);
+            list[0] = static_cast<int32_t>(s.buf.size());
+            std::copy(s.buf.begin(), s.buf.end(), list + 1);
+        }
+
+        cur = s.candidates.front().second;
+        curDist = s.candidates.front().first;
+    }
+
+    if (level > topLevel) {
+        graph.entry = row;
+        graph.maxLevel = level;
+    }
+}
+
+/**
+ * Builds an HNSW graph over every row of an embedding store.
+ *
+ * Levels are drawn up front from options.seed, so the layer structure is
+ * reproducible; with more than one thread the insertion order, and so the
+ * exact links, depend on scheduling.
+ *
+ * @param store The embeddings; not modified, must outlive the graph.
+ * @param options M, beam widths, seed and insertion threads.
+ * @return The graph.
+ */
+template <typename T>
+HnswGraph<T> buildHnsw(const EmbeddingStore &store, const HnswOptions &options = {})
+{
+    HnswOptions opts = options;
+    opts.M = std::max<size_t>(2, opts.M);
+    opts.efConstruction = std::max(opts.efConstruction, opts.M);
+
+    HnswGraph<T> graph;
+    graph.store = &store;
+    graph.M = opts.M;
+    graph.maxM0 = 2 * opts.M;
+    graph.efSearch = std::max<size_t>(1, opts.efSearch);
+    size_t n = store.size();
+    if (n == 0) return graph;
+
+    // level of a row ~ floor(-ln(U) / ln(M))
+    std::mt19937_64 rng(opts.seed);
+    std::uniform_real_distribution<double> uniform(std::nextafter(0.0, 1.0), 1.0);
+    double mL = 1.0 / std::log(static_cast<double>(opts.M));
+    graph.levels.resize(n);
+    graph.upper.resize(n);
+    for (size_t r = 0; r < n; ++r) {
+        int level = std::min(static_cast<int>(-std::log(uniform(rng)) * mL), 31);
+        graph.levels[r] = static_cast<uint8_t>(level);
+        if (level > 0) {
+            graph.upper[r].assign(level * (1 + opts.M), 0);
+        }
+    }
+    graph.links0.assign(n * (1 + graph.maxM0), 0);
+
+    graph.entry = 0;
+    graph.maxLevel = graph.levels[0];
+
+    std::unique_ptr<std::mutex[]> locks(new std::mutex[n]);
+    std::mutex globalLock;
+    std::atomic<size_t> next{1};
+    parallelFor(std::max(1u, opts.threads), [&](unsigned) {
+        HnswBuildScratch scratch;
+        withDistanceSq<T>(store, [&](auto dist) {
+            for (size_t r = next++; r < n; r = next++) {
+                hnswInsert(graph, static_cast<int32_t>(r), opts, locks.get(), globalLock, scratch, dist);
+            }
+        });
+    });
+    return graph;
+}
+
+/**
+ * @brief k-NN search on an HNSW graph.
+ *
+ * Walks greedily from the entry point down to level 1, then runs a beam
+ * search of width max(K, ef) on level 0 and reports the K closest rows found.
+ * Approximate: recall grows with ef, the graph's efSearch.
+ *
+ * @param graph The HNSW graph.
+ * @param query The query, Dim() contiguous floats.
+ * @param K Number of nearest neighbors to search for.
+ * @param ctx Caller-owned context; ctx.results receives the neighbors, valid until its next search.
+ */
+template <typename T>
+void knnSearch(const HnswGraph<T> &graph, const float *query, int K, SearchContext &ctx)
+{
+    ctx.start(Embedding_T<T>::Dim());
+    if (graph.entry < 0) {
+        ctx.small.reset(0);
+        ctx.results = ctx.small.sorted();
+        return;
+    }
+
+    std::vector<int32_t> &buf = ctx.rowBuf;
+    size_t ef = std::max<size_t>(K, graph.efSearch);
+    withDistanceSq<T>(*graph.store, [&](auto dist) {
+        int32_t cur = graph.entry;
+        float curDist = hnswDistance(graph, query, cur, ctx, dist);
+        for (int l = graph.maxLevel; l > 0; --l) {
+            cur = hnswGreedy(graph, query, cur, curDist, l, ctx, nullptr, buf, dist);
+        }
+        hnswSearchLayer(graph, query, cur, curDist, ef, 0, ctx, nullptr, buf, dist);
+    });
+
+    // the beam holds (distance, row) pairs, so ties are broken by row; report the K best by (distance, id)
+    auto collect = [&](auto &top) {
+        top.reset(K);
+        for (const PQItem &item : ctx.beam.sorted()) {
+            top.offer(item.first, graph.store->id(item.second));
+        }
+        ctx.results = top.sorted();
+    };
+    if (K <= kSmallK) {
+        collect(ctx.small);
+    }
+    else {
+        collect(ctx.heap);
+    }
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+#include "knn.hpp"
+#include "kmeans.hpp"
+#include <cmath>
+
+/**
+ * Options of an inverted file index.
+ *
+ * nlist centroids are trained with ALGLIB k-means (k-means++ seeding) on up
+ * to sampleSize rows drawn with `seed`; 0 picks sqrt(n) lists and 64 rows per
+ * list. Queries scan the nprobe lists with the closest centroids. Rows are
+ * assigned to their centroids on `threads` threads.
+ */
+struct IvfOptions
+{
+    size_t nlist = 0;
+    size_t nprobe = 8;
+    size_t sampleSize = 0;
+    int restarts = 1;
+    int maxIterations = 20;
+    uint64_t seed = 1;
+    unsigned threads = 1;
+};
+
+/**
+ * Inverted file index: k-means centroids plus, for each centroid, the block
+ * of store rows closest to it. The store is reordered so that every list is a
+ * contiguous range of rows and must outlive the index.
+ */
+template <typename T>
+struct IvfIndex
+{
+    const EmbeddingStore *store = nullptr;
+    EmbeddingStore centroids;           // one row per list
+    std::vector<int32_t> listStart;     // list l is rows [listStart[l], listStart[l + 1])
+    size_t nprobe = 8;
+
+    size_t nlist() const { return centroids.size(); }
+    size_t size() const { return store ? store->size() : 0; }
+};
+
+// Trains nlist centroids on a random sample of the store with ALGLIB k-means
+inline void trainIvfCentroids(const EmbeddingStore &store, size_t nlist, const IvfOptions &options,
+                              EmbeddingStore &centroids)
+{
+    size_t dim = store.dim();
+    size_t samples = options.sampleSize > 0 ? options.sampleSize : 64 * nlist;
+    std::vector<int32_t> rows = sampleRows(store.size(), std::max(samples, nlist), options.seed);
+
+    alglib::real_2d_array xy;
+    xy.setlength(rows.size(), dim);
+    for (size_t i = 0; i < rows.size(); ++i) {
+        const float *p = store.row(rows[i]);
+        for (size_t d = 0; d < dim; ++d) xy[i][d] = p[d];
+    }
+
+    std::vector<float> trained;
+    kmeans(xy, nlist, {options.restarts, options.maxIterations, options.seed}, trained);
+    for (size_t c = 0; c < trained.size() / dim; ++c) {
+        std::copy_n(&trained[c * dim], dim, centroids.append(static_cast<int>(c)));
+    }
+}
+
+/**
+ * Builds an inverted file index over every row of an embedding store.
+ * Centroids come from k-means on a sample, then every row is assigned to its
+ * nearest centroid and the store is reordered list by list.
+ *
+ * @param store The embeddings to index; reordered in place, it must outlive the index.
+ * @param options Number of lists, training sample, nprobe and threads.
+ * @return The index.
+ */
+template <typename T>
+IvfIndex<T> buildIvf(EmbeddingStore &store, const IvfOptions &options = {})
+{
+    IvfIndex<T> index;
+    index.store = &store;
+    index.centroids = EmbeddingStore(store.dim(), store.stride() != store.dim());
+    index.nprobe = std::max<size_t>(1, options.nprobe);
+    size_t n = store.size();
+    if (n == 0) {
+        index.listStart.assign(1, 0);
+        return index;
+    }
+
+    size_t nlist = options.nlist > 0 ? options.nlist : static_cast<size_t>(std::sqrt(static_cast<double>(n)));
+    nlist = std::clamp<size_t>(nlist, 1, n);
+    trainIvfCentroids(store, nlist, options, index.centroids);
+    nlist = index.centroids.size();
+
+    // nearest centroid of every row
+    std::vector<int32_t> list(n);
+    unsigned threads = std::max(1u, options.threads);
+    parallelFor(threads, [&](unsigned t) {
+        for (size_t r = n * t / threads; r < n * (t + 1) / threads; ++r) {
+            float best = std::numeric_limits<float>::infinity();
+            for (size_t c = 0; c < nlist; ++c) {
+                float d = Embedding_T<T>::distance_sq(store.row(r), index.centroids.row(c));
+                if (d < best) {
+                    best = d;
+                    list[r] = static_cast<int32_t>(c);
+                }
+            }
+        }
+    });
+
+    // counting sort of the rows by list, stable so rows keep their order within a list
+    index.listStart.assign(nlist + 1, 0);
+    for (int32_t l : list) ++index.listStart[l + 1];
+    std::partial_sum(index.listStart.begin(), index.listStart.end(), index.listStart.begin());
+    std::vector<int32_t> order(n);
+    std::vector<int32_t> next(index.listStart.begin(), index.listStart.end() - 1);
+    for (size_t r = 0; r < n; ++r) {
+        order[next[list[r]]++] = static_cast<int32_t>(r);
+    }
+    store.permute(order);
+    return index;
+}
+
+/**
+ * @brief k-NN search on an inverted file index.
+ *
+ * Ranks the centroids by distance to the query and scans the rows of the
+ * closest index.nprobe lists.
+ * Approximate: neighbors in lists that are not probed are missed; probing
+ * every list is an exact scan.
+ *
+ * @param index The inverted file index.
+ * @param query The query, Dim() contiguous floats.
+ * @param K Number of nearest neighbors to search for.
+ * @param ctx Caller-owned context; ctx.results receives the neighbors, valid until its next search.
+ */
+template <typename T>
+void knnSearch(const IvfIndex<T> &index, const float *query, int K, SearchContext &ctx)
+{
+    ctx.start(Embedding_T<T>::Dim());
+    const EmbeddingStore &store = *index.store;
+    size_t nprobe = std::min(index.nprobe, index.nlist());
+
+    withDistanceSq<T>(store, [&](auto dist) {
+        // closest centroids, reusing the graph beam as a bounded heap
+        TopK &probes = ctx.beam;
+        probes.reset(static_cast<int>(nprobe));
+        for (size_t c = 0; c < index.nlist(); ++c) {
+            probes.offer(dist(query, index.centroids.row(c)), static_cast<int>(c));
+        }
+
+        auto scan = [&](auto &top) {
+            top.reset(K);
+            for (const PQItem &probe : probes.sorted()) {
+                int32_t end = index.listStart[probe.second + 1];
+                for (int32_t r = index.listStart[probe.second]; r < end; ++r) {
+                    ++ctx.checks;
+                    top.offer(dist(query, r), store.id(r));
+                }
+                ++ctx.nodesVisited;
+            }
+            ctx.results = top.sorted();
+        };
+        if (K <= kSmallK) {
+            scan(ctx.small);
+        }
+        else {
+            scan(ctx.heap);
+        }
+    });
+}
@@ -0,0 +1,819 @@
+#pragma once
+
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KNN_X86_KERNELS 1
+#endif
+
+
+/**
+ * @brief One set of distance kernels over n contiguous floats.
+ *
+ * l2sq is the squared Euclidean distance, dot the inner product, l1 the
+ * Manhattan distance and linf the Chebyshev distance (largest coordinate
+ * difference). Rows do not need any alignment or padding.
+ */
+struct DistanceKernels
+{
+    const char *name;
+    float (*l2sq)(const float *a, const float *b, size_t n);
+    float (*dot)(const float *a, const float *b, size_t n);
+    float (*l1)(const float *a, const float *b, size_t n);
+    float (*linf)(const float *a, const float *b, size_t n);
+};
+
+
+// portable kernels, also used for the tails of the vector ones
+
+inline float l2sqScalar(const float *a, const float *b, size_t n)
+{
+    float s = 0;
+    for (size_t i = 0; i < n; ++i) {
+        float d = a[i] - b[i];
+        s += d * d;
+    }
+    return s;
+}
+
+inline float dotScalar(const float *a, const float *b, size_t n)
+{
+    float s = 0;
+    for (size_t i = 0; i < n; ++i) {
+        s += a[i] * b[i];
+    }
+    return s;
+}
+
+inline float l1Scalar(const float *a, const float *b, size_t n)
+{
+    float s = 0;
+    for (size_t i = 0; i < n; ++i) {
+        s += std::abs(a[i] - b[i]);
+    }
+    return s;
+}
+
+inline float linfScalar(const float *a, const float *b, size_t n)
+{
+    float m = 0;
+    for (size_t i = 0; i < n; ++i) {
+        m = std::max(m, std::abs(a[i] - b[i]));
+    }
+    return m;
+}
+
+
+#ifdef KNN_X86_KERNELS
+
+// Each ISA gets its own functions compiled with a target attribute, so the
+// binary keeps the baseline -O3 flags and picks a set at startup. Two
+// accumulators hide the add/FMA latency; leftovers go through the scalar loop.
+
+inline float hsum128(__m128 v)
+{
+    __m128 hi = _mm_movehl_ps(v, v);
+    v = _mm_add_ps(v, hi);
+    hi = _mm_shuffle_ps(v, v, 0x1);
+    return _mm_cvtss_f32(_mm_add_ss(v, hi));
+}
+
+inline float l2sqSse2(const float *a, const float *b, size_t n)
+{
+    __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+        s0 = _mm_add_ps(s0, _mm_mul_ps(d0, d0));
+        s1 = _mm_add_ps(s1, _mm_mul_ps(d1, d1));
+    }
+    return hsum128(_mm_add_ps(s0, s1)) + l2sqScalar(a + i, b + i, n - i);
+}
+
+inline float dotSse2(const float *a, const float *b, size_t n)
+{
+    __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    return hsum128(_mm_add_ps(s0, s1)) + dotScalar(a + i, b + i, n - i);
+}
+
+inline float l1Sse2(const float *a, const float *b, size_t n)
+{
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+        s0 = _mm_add_ps(s0, _mm_andnot_ps(sign, d0));
+        s1 = _mm_add_ps(s1, _mm_andnot_ps(sign, d1));
+    }
+    return hsum128(_mm_add_ps(s0, s1)) + l1Scalar(a + i, b + i, n - i);
+}
+
+inline float hmax128(__m128 v)
+{
+    v = _mm_max_ps(v, _mm_movehl_ps(v, v));
+    return _mm_cvtss_f32(_mm_max_ss(v, _mm_shuffle_ps(v, v, 0x1)));
+}
+
+inline float linfSse2(const float *a, const float *b, size_t n)
+{
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 m0 = _mm_setzero_ps(), m1 = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+        m0 = _mm_max_ps(m0, _mm_andnot_ps(sign, d0));
+        m1 = _mm_max_ps(m1, _mm_andnot_ps(sign, d1));
+    }
+    return std::max(hmax128(_mm_max_ps(m0, m1)), linfScalar(a + i, b + i, n - i));
+}
+
+__attribute__((target("avx2")))
+inline float hsum256(__m256 v)
+{
+    return hsum128(_mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+}
+
+__attribute__((target("avx2")))
+inline float l2sqAvx2(const float *a, const float *b, size_t n)
+{
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        s0 = _mm256_add_ps(s0, _mm256_mul_ps(d0, d0));
+        s1 = _mm256_add_ps(s1, _mm256_mul_ps(d1, d1));
+    }
+    return hsum256(_mm256_add_ps(s0, s1)) + l2sqSse2(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline float dotAvx2(const float *a, const float *b, size_t n)
+{
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        s0 = _mm256_add_ps(s0, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+        s1 = _mm256_add_ps(s1, _mm256_mul_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8)));
+    }
+    return hsum256(_mm256_add_ps(s0, s1)) + dotSse2(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline float l1Avx2(const float *a, const float *b, size_t n)
+{
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        s0 = _mm256_add_ps(s0, _mm256_andnot_ps(sign, d0));
+        s1 = _mm256_add_ps(s1, _mm256_andnot_ps(sign, d1));
+    }
+    return hsum256(_mm256_add_ps(s0, s1)) + l1Sse2(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline float linfAvx2(const float *a, const float *b, size_t n)
+{
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 m0 = _mm256_setzero_ps(), m1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        m0 = _mm256_max_ps(m0, _mm256_andnot_ps(sign, d0));
+        m1 = _mm256_max_ps(m1, _mm256_andnot_ps(sign, d1));
+    }
+    __m256 m = _mm256_max_ps(m0, m1);
+    __m128 m4 = _mm_max_ps(_mm256_castps256_ps128(m), _mm256_extractf128_ps(m, 1));
+    return std::max(hmax128(m4), linfSse2(a + i, b + i, n - i));
+}
+
+__attribute__((target("avx2,fma")))
+inline float l2sqFma(const float *a, const float *b, size_t n)
+{
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        s0 = _mm256_fmadd_ps(d0, d0, s0);
+        s1 = _mm256_fmadd_ps(d1, d1, s1);
+    }
+    return hsum256(_mm256_add_ps(s0, s1)) + l2sqSse2(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+inline float dotFma(const float *a, const float *b, size_t n)
+{
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+        s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), s1);
+    }
+    return hsum256(_mm256_add_ps(s0, s1)) + dotSse2(a + i, b + i, n - i);
+}
+
+// (the maskz forms avoid the _mm512_undefined_ps operand of the plain ones,
+// which GCC 12 reports under -Wall)
+__attribute__((target("avx512f")))
+inline float hsum512(__m512 v)
+{
+    v = _mm512_add_ps(v, _mm512_maskz_shuffle_f32x4(0xFFFF, v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm512_add_ps(v, _mm512_maskz_shuffle_f32x4(0xFFFF, v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return hsum128(_mm512_maskz_extractf32x4_ps(0xF, v, 0));
+}
+
+// AVX-512 handles the tail with a masked load instead of a scalar loop
+__attribute__((target("avx512f")))
+inline float l2sqAvx512(const float *a, const float *b, size_t n)
+{
+    __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+        s0 = _mm512_fmadd_ps(d0, d0, s0);
+        s1 = _mm512_fmadd_ps(d1, d1, s1);
+    }
+    for (; i < n; i += 16) {
+        __mmask16 m = n - i >= 16 ? 0xFFFF : static_cast<__mmask16>((1u << (n - i)) - 1);
+        __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i));
+        s0 = _mm512_fmadd_ps(d, d, s0);
+    }
+    return hsum512(_mm512_add_ps(s0, s1));
+}
+
+__attribute__((target("avx512f")))
+inline float dotAvx512(const float *a, const float *b, size_t n)
+{
+    __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        s0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), s0);
+        s1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), s1);
+    }
+    for (; i < n; i += 16) {
+        __mmask16 m = n - i >= 16 ? 0xFFFF : static_cast<__mmask16>((1u << (n - i)) - 1);
+        s0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i), s0);
+    }
+    return hsum512(_mm512_add_ps(s0, s1));
+}
+
+__attribute__((target("avx512f")))
+inline float l1Avx512(const float *a, const float *b, size_t n)
+{
+    __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        s0 = _mm512_add_ps(s0, _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i))));
+        s1 = _mm512_add_ps(s1, _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16))));
+    }
+    for (; i < n; i += 16) {
+        __mmask16 m = n - i >= 16 ? 0xFFFF : static_cast<__mmask16>((1u << (n - i)) - 1);
+        __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i));
+        s0 = _mm512_add_ps(s0, _mm512_abs_ps(d));
+    }
+    return hsum512(_mm512_add_ps(s0, s1));
+}
+
+__attribute__((target("avx512f")))
+inline float hmax512(__m512 v)
+{
+    v = _mm512_maskz_max_ps(0xFFFF, v, _mm512_maskz_shuffle_f32x4(0xFFFF, v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm512_maskz_max_ps(0xFFFF, v, _mm512_maskz_shuffle_f32x4(0xFFFF, v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return hmax128(_mm512_maskz_extractf32x4_ps(0xF, v, 0));
+}
+
+__attribute__((target("avx512f")))
+inline float linfAvx512(const float *a, const float *b, size_t n)
+{
+    __m512 m0 = _mm512_setzero_ps(), m1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m512 d0 = _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i)));
+        __m512 d1 = _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16)));
+        m0 = _mm512_maskz_max_ps(0xFFFF, m0, d0);
+        m1 = _mm512_maskz_max_ps(0xFFFF, m1, d1);
+    }
+    for (; i < n; i += 16) {
+        __mmask16 m = n - i >= 16 ? 0xFFFF : static_cast<__mmask16>((1u << (n - i)) - 1);
+        __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i));
+        m0 = _mm512_maskz_max_ps(0xFFFF, m0, _mm512_abs_ps(d));
+    }
+    return hmax512(_mm512_maskz_max_ps(0xFFFF, m0, m1));
+}
+
+#endif
+
+
+// Every kernel set this CPU can run, slowest first (scalar is always there).
+inline std::vector<DistanceKernels> availableKernels()
+{
+    std::vector<DistanceKernels> sets{{"scalar", l2sqScalar, dotScalar, l1Scalar, linfScalar}};
+#ifdef KNN_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        sets.push_back({"sse2", l2sqSse2, dotSse2, l1Sse2, linfSse2});
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        sets.push_back({"avx2", l2sqAvx2, dotAvx2, l1Avx2, linfAvx2});
+        if (__builtin_cpu_supports("fma")) {
+            sets.push_back({"fma", l2sqFma, dotFma, l1Avx2, linfAvx2});
+        }
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        sets.push_back({"avx512", l2sqAvx512, dotAvx512, l1Avx512, linfAvx512});
+    }
+#endif
+    return sets;
+}
+
+// The kernel set used by Embedding_T: the fastest one this CPU supports, picked
+// once at startup. It may be replaced by another entry of availableKernels().
+inline DistanceKernels activeKernels = availableKernels().back();
+
+inline DistanceKernels& distanceKernels()
+{
+    return activeKernels;
+}
+
+
+// Squared L2 for a compile-time length N: the kernel bodies above with n fixed,
+// so their loops are fully unrolled. Picked once at startup like activeKernels.
+template <size_t N>
+inline float l2sqScalarN(const float *a, const float *b) { return l2sqScalar(a, b, N); }
+
+#ifdef KNN_X86_KERNELS
+template <size_t N>
+inline float l2sqSse2N(const float *a, const float *b) { return l2sqSse2(a, b, N); }
+
+template <size_t N>
+__attribute__((target("avx2,fma")))
+inline float l2sqFmaN(const float *a, const float *b) { return l2sqFma(a, b, N); }
+
+template <size_t N>
+__attribute__((target("avx512f")))
+inline float l2sqAvx512N(const float *a, const float *b) { return l2sqAvx512(a, b, N); }
+#endif
+
+// Instruction sets of the l2sqN kernels
+enum class KernelIsa
+{
+    Scalar,
+    Sse2,
+    Fma,
+    Avx512,
+};
+
+inline KernelIsa pickKernelIsa()
+{
+#ifdef KNN_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return KernelIsa::Avx512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return KernelIsa::Fma;
+    if (__builtin_cpu_supports("sse2")) return KernelIsa::Sse2;
+#endif
+    return KernelIsa::Scalar;
+}
+
+inline const KernelIsa kernelIsa = pickKernelIsa();
+
+// The l2sqN kernel of instruction set I, a direct call
+template <KernelIsa I, size_t N>
+inline float l2sqIsaN(const float *a, const float *b)
+{
+#ifdef KNN_X86_KERNELS
+    if constexpr (I == KernelIsa::Avx512) return l2sqAvx512N<N>(a, b);
+    if constexpr (I == KernelIsa::Fma) return l2sqFmaN<N>(a, b);
+    if constexpr (I == KernelIsa::Sse2) return l2sqSse2N<N>(a, b);
+#endif
+    return l2sqScalarN<N>(a, b);
+}
+
+// Asks the CPU rather than reading kernelIsa: l2sqN is a variable template, so
+// its initialization is unordered with kernelIsa's, which may still be Scalar
+// (zero-initialized) at this point
+template <size_t N>
+float (*pickL2sqN())(const float *, const float *)
+{
+    switch (pickKernelIsa()) {
+    case KernelIsa::Avx512: return l2sqIsaN<KernelIsa::Avx512, N>;
+    case KernelIsa::Fma: return l2sqIsaN<KernelIsa::Fma, N>;
+    case KernelIsa::Sse2: return l2sqIsaN<KernelIsa::Sse2, N>;
+    default: return l2sqIsaN<KernelIsa::Scalar, N>;
+    }
+}
+
+// For callers that do not dispatch themselves; search loops use withKernelIsa
+template <size_t N>
+inline float (*const l2sqN)(const float *, const float *) = pickL2sqN<N>();
+
+// Copies of fn(isa) compiled for each instruction set, with every call below
+// them inlined (recursive calls excepted), so l2sqIsaN inlines too
+#ifdef KNN_X86_KERNELS
+template <typename Fn>
+__attribute__((target("avx512f"), flatten))
+void runOnAvx512(Fn &fn) { fn(std::integral_constant<KernelIsa, KernelIsa::Avx512>{}); }
+
+template <typename Fn>
+__attribute__((target("avx2,fma"), flatten))
+void runOnFma(Fn &fn) { fn(std::integral_constant<KernelIsa, KernelIsa::Fma>{}); }
+#endif
+
+template <KernelIsa I, typename Fn>
+__attribute__((flatten))
+void runOnBaseline(Fn &fn) { fn(std::integral_constant<KernelIsa, I>{}); }
+
+/**
+ * @brief Runs fn once with the instruction set of this CPU.
+ *
+ * fn receives a std::integral_constant<KernelIsa, I> and is called from a
+ * function compiled for I, so a search loop inside fn can call
+ * l2sqIsaN<I, N> and have it inlined instead of going through the l2sqN
+ * pointer on every distance. Dispatch costs one switch per call.
+ */
+template <typename Fn>
+void withKernelIsa(Fn &&fn)
+{
+    switch (kernelIsa) {
+#ifdef KNN_X86_KERNELS
+    case KernelIsa::Avx512: runOnAvx512(fn); break;
+    case KernelIsa::Fma: runOnFma(fn); break;
+#endif
+#ifdef __SSE2__
+    // SSE2 is in the build's baseline, so kernelIsa is never Scalar and fn needs no scalar copy
+    default: runOnBaseline<KernelIsa::Sse2>(fn); break;
+#else
+#ifdef KNN_X86_KERNELS
+    case KernelIsa::Sse2: runOnBaseline<KernelIsa::Sse2>(fn); break;
+#endif
+    default: runOnBaseline<KernelIsa::Scalar>(fn); break;
+#endif
+    }
+}
+
+
+// Dot product of 16-bit query weights with an int8 code vector of length n
+// (see sq8.hpp). Codes are widened to 16 bits and pairs of products are summed
+// into 32-bit lanes; the caller keeps |w| * 127 * n below 2^31.
+inline int32_t dotInt16Int8Scalar(const int16_t *w, const int8_t *x, size_t n)
+{
+    int32_t s = 0;
+    for (size_t i = 0; i < n; ++i) {
+        s += int32_t(w[i]) * x[i];
+    }
+    return s;
+}
+
+#ifdef KNN_X86_KERNELS
+__attribute__((target("avx2")))
+inline int32_t hsum256Epi32(__m256i v)
+{
+    __m128i h = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    h = _mm_add_epi32(h, _mm_shuffle_epi32(h, _MM_SHUFFLE(1, 0, 3, 2)));
+    h = _mm_add_epi32(h, _mm_shuffle_epi32(h, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(h);
+}
+
+__attribute__((target("avx2")))
+inline int32_t dotInt16Int8Avx2(const int16_t *w, const int8_t *x, size_t n)
+{
+    __m256i s0 = _mm256_setzero_si256(), s1 = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i x0 = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(x + i)));
+        __m256i x1 = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(x + i + 16)));
+        s0 = _mm256_add_epi32(s0, _mm256_madd_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(w + i)), x0));
+        s1 = _mm256_add_epi32(s1, _mm256_madd_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(w + i + 16)), x1));
+    }
+    return hsum256Epi32(_mm256_add_epi32(s0, s1)) + dotInt16Int8Scalar(w + i, x + i, n - i);
+}
+
+// (maskz extracts for the same GCC 12 warning as hsum512)
+__attribute__((target("avx512f")))
+inline int32_t hsum512Epi32(__m512i v)
+{
+    return hsum256Epi32(_mm256_add_epi32(_mm512_maskz_extracti64x4_epi64(0xF, v, 0), _mm512_maskz_extracti64x4_epi64(0xF, v, 1)));
+}
+
+__attribute__((target("avx512bw")))
+inline int32_t dotInt16Int8Avx512(const int16_t *w, const int8_t *x, size_t n)
+{
+    __m512i s0 = _mm512_setzero_si512(), s1 = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        __m512i x0 = _mm512_cvtepi8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(x + i)));
+        __m512i x1 = _mm512_cvtepi8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(x + i + 32)));
+        s0 = _mm512_add_epi32(s0, _mm512_madd_epi16(_mm512_loadu_si512(w + i), x0));
+        s1 = _mm512_add_epi32(s1, _mm512_madd_epi16(_mm512_loadu_si512(w + i + 32), x1));
+    }
+    if (i + 32 <= n) {
+        __m512i x0 = _mm512_cvtepi8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(x + i)));
+        s0 = _mm512_add_epi32(s0, _mm512_madd_epi16(_mm512_loadu_si512(w + i), x0));
+        i += 32;
+    }
+    return hsum512Epi32(_mm512_add_epi32(s0, s1)) + dotInt16Int8Scalar(w + i, x + i, n - i);
+}
+
+// VNNI fuses the multiply-add and the accumulation
+__attribute__((target("avx512bw,avx512vnni")))
+inline int32_t dotInt16Int8Vnni(const int16_t *w, const int8_t *x, size_t n)
+{
+    __m512i s0 = _mm512_setzero_si512(), s1 = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        __m512i x0 = _mm512_cvtepi8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(x + i)));
+        __m512i x1 = _mm512_cvtepi8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(x + i + 32)));
+        s0 = _mm512_dpwssd_epi32(s0, _mm512_loadu_si512(w + i), x0);
+        s1 = _mm512_dpwssd_epi32(s1, _mm512_loadu_si512(w + i + 32), x1);
+    }
+    if (i + 32 <= n) {
+        __m512i x0 = _mm512_cvtepi8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(x + i)));
+        s0 = _mm512_dpwssd_epi32(s0, _mm512_loadu_si512(w + i), x0);
+        i += 32;
+    }
+    return hsum512Epi32(_mm512_add_epi32(s0, s1)) + dotInt16Int8Scalar(w + i, x + i, n - i);
+}
+#endif
+
+using DotInt16Int8 = int32_t (*)(const int16_t *, const int8_t *, size_t);
+
+inline DotInt16Int8 pickDotInt16Int8()
+{
+#ifdef KNN_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vnni")) return dotInt16Int8Vnni;
+    if (__builtin_cpu_supports("avx512bw")) return dotInt16Int8Avx512;
+    if (__builtin_cpu_supports("avx2")) return dotInt16Int8Avx2;
+#endif
+    return dotInt16Int8Scalar;
+}
+
+inline const DotInt16Int8 dotInt16Int8 = pickDotInt16Int8();
+
+
+// IEEE half (fp16) and bfloat16 conversions, round to nearest even. fp16
+// keeps 11 significant bits over [6e-8, 65504] (larger values become inf);
+// bf16 keeps the float exponent range with 8 significant bits.
+
+inline uint16_t floatToF16(float f)
+{
+    uint32_t x = std::bit_cast<uint32_t>(f);
+    uint16_t sign = static_cast<uint16_t>((x >> 16) & 0x8000);
+    uint32_t mag = x & 0x7FFFFFFF;
+    if (mag >= 0x7F800000) {
+        return sign | 0x7C00 | (mag > 0x7F800000 ? 0x200 : 0);    // inf, quiet NaN
+    }
+    if (mag < 0x38800000) {
+        // below 2^-14: subnormal half, value / 2^-24 rounded
+        if (mag <= 0x33000000) return sign;
+        uint32_t m = (mag & 0x7FFFFF) | 0x800000;
+        uint32_t shift = 126 - (mag >> 23);
+        uint32_t r = m >> shift, rem = m & ((1u << shift) - 1), half = 1u << (shift - 1);
+        if (rem > half || (rem == half && (r & 1))) ++r;
+        return sign | static_cast<uint16_t>(r);
+    }
+    // rebias the exponent and round off 13 mantissa bits; a carry into the
+    // exponent is the correct result, up to inf
+    uint32_t v = mag - (112u << 23);
+    uint32_t r = v >> 13, rem = v & 0x1FFF;
+    if (rem > 0x1000 || (rem == 0x1000 && (r & 1))) ++r;
+    return sign | static_cast<uint16_t>(std::min<uint32_t>(r, 0x7C00));
+}
+
+inline float f16ToFloat(uint16_t h)
+{
+    uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+    uint32_t e = (h >> 10) & 0x1F, m = h & 0x3FF;
+    if (e == 0) {
+        float f = std::ldexp(static_cast<float>(m), -24);
+        return sign ? -f : f;
+    }
+    if (e == 31) return std::bit_cast<float>(sign | 0x7F800000 | (m << 13));
+    return std::bit_cast<float>(sign | ((e + 112) << 23) | (m << 13));
+}
+
+inline uint16_t floatToBf16(float f)
+{
+    uint32_t x = std::bit_cast<uint32_t>(f);
+    if ((x & 0x7FFFFFFF) > 0x7F800000) return static_cast<uint16_t>((x >> 16) | 0x40);   // quiet NaN
+    return static_cast<uint16_t>((x + 0x7FFF + ((x >> 16) & 1)) >> 16);
+}
+
+inline float bf16ToFloat(uint16_t h)
+{
+    return std::bit_cast<float>(static_cast<uint32_t>(h) << 16);
+}
+
+
+// Squared L2 between a float query and a half-precision row of length n, the
+// row widened to float on the fly (F16C / AVX-512 for fp16; a bf16 value is
+// the high half of a float, so widening is a 16-bit shift). Accumulation is
+// in float as in l2sq, so the only error is the rounding of the stored row.
+
+inline float l2sqF16Scalar(const float *a, const uint16_t *b, size_t n)
+{
+    float s = 0;
+    for (size_t i = 0; i < n; ++i) {
+        float d = a[i] - f16ToFloat(b[i]);
+        s += d * d;
+    }
+    return s;
+}
+
+inline float l2sqBf16Scalar(const float *a, const uint16_t *b, size_t n)
+{
+    float s = 0;
+    for (size_t i = 0; i < n; ++i) {
+        float d = a[i] - bf16ToFloat(b[i]);
+        s += d * d;
+    }
+    return s;
+}
+
+#ifdef KNN_X86_KERNELS
+__attribute__((target("avx2,fma,f16c")))
+inline float l2sqF16F16c(const float *a, const uint16_t *b, size_t n)
+{
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i),
+                                  _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i))));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8),
+                                  _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i + 8))));
+        s0 = _mm256_fmadd_ps(d0, d0, s0);
+        s1 = _mm256_fmadd_ps(d1, d1, s1);
+    }
+    if (i + 8 <= n) {
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i))));
+        s0 = _mm256_fmadd_ps(d, d, s0);
+        i += 8;
+    }
+    return hsum256(_mm256_add_ps(s0, s1)) + l2sqF16Scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+inline float l2sqBf16Avx2(const float *a, const uint16_t *b, size_t n)
+{
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i w0 = _mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i))), 16);
+        __m256i w1 = _mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i + 8))), 16);
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_castsi256_ps(w0));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_castsi256_ps(w1));
+        s0 = _mm256_fmadd_ps(d0, d0, s0);
+        s1 = _mm256_fmadd_ps(d1, d1, s1);
+    }
+    if (i + 8 <= n) {
+        __m256i w = _mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i))), 16);
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_castsi256_ps(w));
+        s0 = _mm256_fmadd_ps(d, d, s0);
+        i += 8;
+    }
+    return hsum256(_mm256_add_ps(s0, s1)) + l2sqBf16Scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+inline float l2sqF16Avx512(const float *a, const uint16_t *b, size_t n)
+{
+    __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i),
+                                  _mm512_maskz_cvtph_ps(0xFFFF, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i))));
+        __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16),
+                                  _mm512_maskz_cvtph_ps(0xFFFF, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i + 16))));
+        s0 = _mm512_fmadd_ps(d0, d0, s0);
+        s1 = _mm512_fmadd_ps(d1, d1, s1);
+    }
+    if (i + 16 <= n) {
+        __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + i),
+                                 _mm512_maskz_cvtph_ps(0xFFFF, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i))));
+        s0 = _mm512_fmadd_ps(d, d, s0);
+        i += 16;
+    }
+    return hsum512(_mm512_add_ps(s0, s1)) + l2sqF16Scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+inline float l2sqBf16Avx512(const float *a, const uint16_t *b, size_t n)
+{
+    __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m512i w0 = _mm512_maskz_slli_epi32(0xFFFF, _mm512_maskz_cvtepu16_epi32(0xFFFF, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i))), 16);
+        __m512i w1 = _mm512_maskz_slli_epi32(0xFFFF, _mm512_maskz_cvtepu16_epi32(0xFFFF, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i + 16))), 16);
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_castsi512_ps(w0));
+        __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_castsi512_ps(w1));
+        s0 = _mm512_fmadd_ps(d0, d0, s0);
+        s1 = _mm512_fmadd_ps(d1, d1, s1);
+    }
+    if (i + 16 <= n) {
+        __m512i w = _mm512_maskz_slli_epi32(0xFFFF, _mm512_maskz_cvtepu16_epi32(0xFFFF, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i))), 16);
+        __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_castsi512_ps(w));
+        s0 = _mm512_fmadd_ps(d, d, s0);
+        i += 16;
+    }
+    return hsum512(_mm512_add_ps(s0, s1)) + l2sqBf16Scalar(a + i, b + i, n - i);
+}
+#endif
+
+using L2sqHalf = float (*)(const float *, const uint16_t *, size_t);
+
+inline L2sqHalf pickL2sqF16()
+{
+#ifdef KNN_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return l2sqF16Avx512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c")) {
+        return l2sqF16F16c;
+    }
+#endif
+    return l2sqF16Scalar;
+}
+
+inline L2sqHalf pickL2sqBf16()
+{
+#ifdef KNN_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return l2sqBf16Avx512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return l2sqBf16Avx2;
+#endif
+    return l2sqBf16Scalar;
+}
+
+inline const L2sqHalf l2sqF16 = pickL2sqF16();
+inline const L2sqHalf l2sqBf16 = pickL2sqBf16();
+
+
+// Hamming distance between two bit vectors of `words` 64-bit words: 64-bit
+// POPCNT per word, or VPOPCNTQ on eight words at a time (binary.hpp).
+inline uint32_t hammingScalar(const uint64_t *a, const uint64_t *b, size_t words)
+{
+    uint32_t s = 0;
+    for (size_t i = 0; i < words; ++i) {
+        s += static_cast<uint32_t>(__builtin_popcountll(a[i] ^ b[i]));
+    }
+    return s;
+}
+
+#ifdef KNN_X86_KERNELS
+__attribute__((target("popcnt")))
+inline uint32_t hammingPopcnt(const uint64_t *a, const uint64_t *b, size_t words)
+{
+    uint64_t s = 0;
+    for (size_t i = 0; i < words; ++i) {
+        s += static_cast<uint64_t>(_mm_popcnt_u64(a[i] ^ b[i]));
+    }
+    return static_cast<uint32_t>(s);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+inline uint32_t hammingAvx512(const uint64_t *a, const uint64_t *b, size_t words)
+{
+    __m512i s = _mm512_setzero_si512();
+    for (size_t i = 0; i < words; i += 8) {
+        __mmask8 m = words - i >= 8 ? 0xFF : static_cast<__mmask8>((1u << (words - i)) - 1);
+        __m512i x = _mm512_xor_si512(_mm512_maskz_loadu_epi64(m, a + i), _mm512_maskz_loadu_epi64(m, b + i));
+        s = _mm512_add_epi64(s, _mm512_popcnt_epi64(x));
+    }
+    __m256i h = _mm256_add_epi64(_mm512_maskz_extracti64x4_epi64(0xF, s, 0), _mm512_maskz_extracti64x4_epi64(0xF, s, 1));
+    __m128i v = _mm_add_epi64(_mm256_castsi256_si128(h), _mm256_extracti128_si256(h, 1));
+    return static_cast<uint32_t>(_mm_cvtsi128_si64(v) + _mm_extract_epi64(v, 1));
+}
+#endif
+
+using Hamming = uint32_t (*)(const uint64_t *, const uint64_t *, size_t);
+
+inline Hamming pickHamming()
+{
+#ifdef KNN_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512vpopcntdq")) return hammingAvx512;
+    if (__builtin_cpu_supports("popcnt")) return hammingPopcnt;
+#endif
+    return hammingScalar;
+}
+
+inline const Hamming hamming = pickHamming();
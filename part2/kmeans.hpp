@@ -0,0 +1,88 @@
+#pragma once
+
+#include "knn.hpp"
+#include "dataanalysis.h"
+#include <numeric>
+#include <random>
+#include <stdexcept>
+
+// Settings of one ALGLIB k-means run (k-means++ seeding)
+struct KMeansOptions
+{
+    int restarts = 1;
+    int maxIterations = 20;     // 0 = until convergence
+    uint64_t seed = 1;
+};
+
+// Draws `samples` distinct rows of [0, n) at random, in draw order.
+inline std::vector<int32_t> sampleRows(size_t n, size_t samples, uint64_t seed)
+{
+    samples = std::min(samples, n);
+    std::vector<int32_t> rows(n);
+    std::iota(rows.begin(), rows.end(), 0);
+    std::mt19937_64 rng(seed);
+    for (size_t i = 0; i < samples; ++i) {
+        std::swap(rows[i], rows[std::uniform_int_distribution<size_t>(i, n - 1)(rng)]);
+    }
+    rows.resize(samples);
+    return rows;
+}
+
+// The rows of xy that differ from every row before them in sorted order, i.e. one per distinct point.
+inline std::vector<size_t> distinctRows(const alglib::real_2d_array &xy)
+{
+    size_t n = xy.rows(), dim = xy.cols();
+    auto less = [&](size_t a, size_t b) {
+        return std::lexicographical_compare(&xy[a][0], &xy[a][0] + dim, &xy[b][0], &xy[b][0] + dim);
+    };
+    std::vector<size_t> rows(n);
+    std::iota(rows.begin(), rows.end(), 0);
+    std::sort(rows.begin(), rows.end(), less);
+    rows.erase(std::unique(rows.begin(), rows.end(), [&](size_t a, size_t b) { return !less(a, b); }),
+               rows.end());
+    return rows;
+}
+
+/**
+ * Clusters the points of xy (one per row) into k centroids with ALGLIB.
+ *
+ * ALGLIB rejects k larger than the number of distinct points, so with at most
+ * k distinct points those points are returned as the centroids instead, and
+ * there are fewer than k of them.
+ *
+ * @param xy The training points.
+ * @param k Number of clusters.
+ * @param options Restarts, iteration limit and seed.
+ * @param centroids Receives min(k, distinct points) centroids, row-major, xy.cols() floats each.
+ * @throws std::runtime_error if ALGLIB reports a failure.
+ */
+inline void kmeans(const alglib::real_2d_array &xy, size_t k, const KMeansOptions &options,
+                   std::vector<float> &centroids)
+{
+    size_t dim = xy.cols();
+    std::vector<size_t> distinct = distinctRows(xy);
+    if (distinct.size() <= k) {
+        centroids.resize(distinct.size() * dim);
+        for (size_t c = 0; c < distinct.size(); ++c) {
+            for (size_t d = 0; d < dim; ++d) centroids[c * dim + d] = static_cast<float>(xy[distinct[c]][d]);
+        }
+        return;
+    }
+
+    alglib::clusterizerstate state;
+    alglib::kmeansreport report;
+    alglib::clusterizercreate(state);
+    alglib::clusterizersetpoints(state, xy, xy.rows(), dim, 2);   // 2 = Euclidean
+    alglib::clusterizersetkmeanslimits(state, std::max(1, options.restarts), std::max(0, options.maxIterations));
+    alglib::clusterizersetseed(state, static_cast<alglib::ae_int_t>(options.seed % INT32_MAX));
+    alglib::clusterizerrunkmeans(state, k, report);
+    if (report.terminationtype <= 0) {
+        throw std::runtime_error("k-means failed with termination type " +
+                                 std::to_string(report.terminationtype));
+    }
+
+    centroids.resize(report.k * dim);
+    for (size_t c = 0; c < static_cast<size_t>(report.k); ++c) {
+        for (size_t d = 0; d < dim; ++d) centroids[c * dim + d] = static_cast<float>(report.c[c][d]);
+    }
+}
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <iostream>
 #include <fstream>
 #include <vector>
@@ -5,6 +7,18 @@
 #include <nlohmann/json.hpp>
 #include <chrono>
 #include <queue>
+#include <array>
+#include <type_traits>
+#include <cstdint>
+#include <new>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <span>
+#include <limits>
+#include <bit>
+#include "kernels.hpp"
+#include "threadpool.hpp"
 
 
 template <typename T, typename = void>
@@ -20,6 +34,18 @@ struct Embedding_T<float>
     {
         return std::abs(a - b);
     }
+
+    static float distance(const float *a, const float *b)
+    {
+        return std::abs(*a - *b);
+    }
+
+    // squared distance, ordered the same way as distance but without the abs/sqrt
+    static float distance_sq(const float *a, const float *b)
+    {
+        float d = *a - *b;
+        return d * d;
+    }
 };
 
 // dynamic vector: runtime-D (global, set once at startup)
@@ -37,16 +63,95 @@ struct Embedding_T<std::vector<float>>
     static float distance(const std::vector<float> &a,
                           const std::vector<float> &b)
     {
-        float s = 0;
-        for (size_t i = 0; i < Dim(); ++i)
-        {
-            float d = a[i] - b[i];
-            s += d * d;
+        return distance(a.data(), b.data());
+    }
+
+    // rows of an EmbeddingStore or any other Dim() contiguous floats
+    static float distance(const float *a, const float *b)
+    {
+        return std::sqrt(distance_sq(a, b));
+    }
+
+    // squared distance, ordered the same way as distance but without the sqrt;
+    // runs on the SIMD kernel set picked for this CPU (see kernels.hpp)
+    static float distance_sq(const float *a, const float *b)
+    {
+        return distanceKernels().l2sq(a, b, Dim());
+    }
+};
+
+// fixed-size array: N-D known at compile time, so every loop has a constant
+// trip count; small N is unrolled inline, larger N uses the l2sqN<N> SIMD kernel
+template <size_t N>
+struct Embedding_T<std::array<float, N>>
+{
+    static constexpr size_t Dim() { return N; }
+
+    static float distance(const std::array<float, N> &a,
+                          const std::array<float, N> &b)
+    {
+        return distance(a.data(), b.data());
+    }
+
+    static float distance(const float *a, const float *b)
+    {
+        return std::sqrt(distance_sq(a, b));
+    }
+
+    static float distance_sq(const float *a, const float *b)
+    {
+        if constexpr (N < 16) {
+            float s = 0;
+            for (size_t i = 0; i < N; ++i)
+            {
+                float d = a[i] - b[i];
+                s += d * d;
+            }
+            return s;
+        } else {
+            return l2sqN<N>(a, b);
+        }
+    }
+
+    // distance_sq with the kernel of instruction set I called directly (see withDistanceSq)
+    template <KernelIsa I>
+    static float distance_sq(const float *a, const float *b)
+    {
+        if constexpr (N < 16) {
+            return distance_sq(a, b);
+        } else {
+            return l2sqIsaN<I, N>(a, b);
         }
-        return std::sqrt(s);
     }
 };
 
+// Embedding types whose distance_sq goes through a runtime-dispatched kernel
+// that withDistanceSq can pick once per search instead
+template <typename T>
+constexpr bool kDispatchedDistance = false;
+
+template <size_t N>
+constexpr bool kDispatchedDistance<std::array<float, N>> = N >= 16;
+
+// Calls fn(std::type_identity<T>{}) with the embedding type used for dim:
+// float for 1-D, std::array<float, dim> for the common fixed sizes and
+// std::vector<float> (runtime_dim()) for any other dimension.
+template <typename Fn>
+auto withEmbeddingType(size_t dim, Fn &&fn)
+{
+    switch (dim) {
+    case 1:   return fn(std::type_identity<float>{});
+    case 2:   return fn(std::type_identity<std::array<float, 2>>{});
+    case 3:   return fn(std::type_identity<std::array<float, 3>>{});
+    case 4:   return fn(std::type_identity<std::array<float, 4>>{});
+    case 20:  return fn(std::type_identity<std::array<float, 20>>{});
+    case 128: return fn(std::type_identity<std::array<float, 128>>{});
+    case 384: return fn(std::type_identity<std::array<float, 384>>{});
+    case 768: return fn(std::type_identity<std::array<float, 768>>{});
+    default:  return fn(std::type_identity<std::vector<float>>{});
+    }
+}
+
 
 // extract the “axis”-th coordinate or the scalar itself
 template<typename T>
@@ -58,8 +163,303 @@ constexpr float getCoordinate(T const &e, size_t axis) {
     }
 }
 
+// pointer to the Dim() coordinates of an embedding
+template<typename T>
+const float* coords(T const &e) {
+    if constexpr (std::is_same_v<T, float>) {
+        return &e;         // scalar case
+    } else {
+        return e.data();   // vector case
+    }
+}
+
+// rebuild an embedding of type T from Dim() contiguous floats
+template<typename T>
+T fromRow(const float *row) {
+    if constexpr (std::is_same_v<T, float>) {
+        return *row;
+    } else if constexpr (std::is_same_v<T, std::vector<float>>) {
+        return T(row, row + Embedding_T<T>::Dim());
+    } else {
+        T e;
+        std::copy(row, row + Embedding_T<T>::Dim(), e.begin());
+        return e;
+    }
+}
+
+// Copies a JSON embedding (a number in 1-D, an array otherwise) into dim floats.
+inline void readEmbedding(const nlohmann::json &emb, float *out, size_t dim)
+{
+    if (emb.is_number()) {
+        out[0] = emb.get<float>();
+        return;
+    }
+    for (size_t i = 0; i < dim; ++i) {
+        out[i] = emb[i].get<float>();
+    }
+}
+
+
+// Allocator returning Align-byte aligned blocks (cache-line aligned by default).
+template <typename U, size_t Align = 64>
+struct AlignedAllocator
+{
+    using value_type = U;
+
+    template <typename V>
+    struct rebind { using other = AlignedAllocator<V, Align>; };
+
+    AlignedAllocator() = default;
+    template <typename V>
+    AlignedAllocator(const AlignedAllocator<V, Align> &) {}
+
+    U* allocate(size_t n)
+    {
+        return static_cast<U*>(::operator new(n * sizeof(U), std::align_val_t(Align)));
+    }
+
+    void deallocate(U *p, size_t)
+    {
+        ::operator delete(p, std::align_val_t(Align));
+    }
+
+    template <typename V>
+    bool operator==(const AlignedAllocator<V, Align> &) const { return true; }
+};
+
+
+// Element type of the rows of an EmbeddingStore
+enum class Storage
+{
+    F32,
+    F16,    // IEEE binary16: 11 significant bits, |x| <= 65504
+    BF16,   // bfloat16: 8 significant bits, float range
+};
+
+/**
+ * @brief All embeddings of a dataset in one aligned, row-major float buffer.
+ *
+ * Points are referred to by row index; id(row) gives back the passage id.
+ * Rows are dim() floats long. With pad = true each row is rounded up to a
+ * multiple of 16 floats (64 bytes) and the padding is zero, so every row
+ * starts on a cache line and kernels may run over the padding.
+ *
+ * computeNorms() caches the Euclidean norm of every row for the metrics that
+ * need it (see metric.hpp); the cache follows the rows through permute().
+ *
+ * Once an index is built, toHalf() can round the rows to fp16 or bf16 and
+ * drop the fp32 ones, halving the memory and bandwidth of the rows. The
+ * searches read rows only through withDistanceSq and coordinate(), which
+ * widen half-precision rows on the fly.
+ */
+class EmbeddingStore
+{
+public:
+    static constexpr size_t kPadFloats = 16;
+
+    explicit EmbeddingStore(size_t dim = 0, bool pad = false)
+        : dim_(dim),
+          stride_(pad ? (dim + kPadFloats - 1) / kPadFloats * kPadFloats : dim)
+    {
+    }
+
+    size_t dim() const { return dim_; }
+    size_t stride() const { return stride_; }
+    size_t size() const { return ids_.size(); }
+    Storage storage() const { return storage_; }
+
+    void reserve(size_t rows)
+    {
+        data_.reserve(rows * stride_);
+        ids_.reserve(rows);
+    }
+
+    // Appends a zeroed row for the given id and returns it to be filled in.
+    float* append(int id)
+    {
+        data_.resize(data_.size() + stride_, 0.0f);
+        ids_.push_back(id);
+        return row(ids_.size() - 1);
+    }
+
+    // Reorders the rows so that new row i is old row order[i].
+    void permute(const std::vector<int32_t> &order)
+    {
+        std::vector<float, AlignedAllocator<float>> data(order.size() * stride_);
+        std::vector<int> ids(order.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            std::copy(row(order[i]), row(order[i]) + stride_, data.data() + i * stride_);
+            ids[i] = ids_[order[i]];
+        }
+        data_.swap(data);
+        ids_.swap(ids);
+        if (!norms_.empty()) {
+            std::vector<float> norms(order.size());
+            for (size_t i = 0; i < order.size(); ++i) norms[i] = norms_[order[i]];
+            norms_.swap(norms);
+        }
+    }
+
+    // Caches the norm of every row as it is now; later changes to the rows
+    // (e.g. normalizing them) leave the cached values alone.
+    void computeNorms()
+    {
+        norms_.resize(size());
+        for (size_t r = 0; r < size(); ++r) {
+            norms_[r] = std::sqrt(distanceKernels().dot(row(r), row(r), dim_));
+        }
+    }
+
+    bool hasNorms() const { return norms_.size() == size(); }
+    float norm(size_t r) const { return norms_[r]; }
+
+    // True if the norms are cached and every one is within tolerance of 1
+    bool normalized(float tolerance = 1e-3f) const
+    {
+        return hasNorms() && std::all_of(norms_.begin(), norms_.end(),
+                           [&](float n) { return std::abs(n - 1.0f) <= tolerance; });
+    }
+
+    /**
+     * Rounds every row to nearest in a half-precision format and frees the
+     * fp32 rows; row() is invalid afterwards, and the store can no longer be
+     * appended to or permuted. Call it once the index is built: rounding is
+     * monotonic, so the order of the coordinates the builders saw, and
+     * with it the bounds of the k-d tree cells, still holds.
+     *
+     * Tolerance against the fp32 rows: every coordinate x is within u·|x| of
+     * its float value, u = 2^-11 (fp16) or 2^-8 (bf16), and the squared
+     * distance to a query q within 2u·Σ|q_d - x_d|·|x_d| + O(u²). For
+     * unit-norm embeddings that is at most 4u (2e-3 fp16, 1.6e-2 bf16); the
+     * largest errors measured on the 384-d test set are 1.8e-4 and 1.6e-3.
+     * Neighbors whose distances differ by less than that may swap ranks.
+     *
+     * @param storage Storage::F16 or Storage::BF16.
+     */
+    void toHalf(Storage storage)
+    {
+        if (storage == Storage::F32 || storage_ != Storage::F32) return;
+        half_.resize(size() * dim_);
+        for (size_t r = 0; r < size(); ++r) {
+            for (size_t d = 0; d < dim_; ++d) {
+                float x = row(r)[d];
+                half_[r * dim_ + d] = storage == Storage::F16 ? floatToF16(x) : floatToBf16(x);
+            }
+        }
+        std::vector<float, AlignedAllocator<float>>().swap(data_);
+        storage_ = storage;
+    }
+
+    const float* row(size_t r) const { return data_.data() + r * stride_; }
+    float* row(size_t r) { return data_.data() + r * stride_; }
+    // Row r of a half-precision store, dim() values
+    const uint16_t* halfRow(size_t r) const { return half_.data() + r * dim_; }
+    int id(size_t r) const { return ids_[r]; }
+
+    // Coordinate d of row r, whatever the storage
+    float coordinate(size_t r, size_t d) const
+    {
+        switch (storage_) {
+        case Storage::F16: return f16ToFloat(halfRow(r)[d]);
+        case Storage::BF16: return bf16ToFloat(halfRow(r)[d]);
+        default: return row(r)[d];
+        }
+    }
+
+    // Starts loading row r into the cache
+    void prefetch(size_t r) const
+    {
+        if (storage_ == Storage::F32) {
+            __builtin_prefetch(row(r));
+        }
+        else {
+            __builtin_prefetch(halfRow(r));
+        }
+    }
+
+private:
+    size_t dim_;
+    size_t stride_;
+    Storage storage_ = Storage::F32;
+    std::vector<float, AlignedAllocator<float>> data_;
+    std::vector<uint16_t, AlignedAllocator<uint16_t>> half_;
+    std::vector<int> ids_;
+    std::vector<float> norms_;
+};
+
+
+/**
+ * @brief How one search reads the rows of a store.
+ *
+ * dist(a, b) is the squared L2 distance between two vectors of Dim() floats,
+ * dist(query, r) that from a query to row r of the store and
+ * dist.coordinate(r, d) coordinate d of row r. Half says whether the rows are
+ * half precision, so fp32 searches pay nothing for it; see withDistanceSq.
+ */
+template <typename Pair, bool Half>
+struct StoreDistance
+{
+    Pair pair;                      // squared L2 between two float vectors
+    const EmbeddingStore *store;
+    L2sqHalf half;                  // widening kernel of a half-precision store
+
+    float operator()(const float *a, const float *b) const { return pair(a, b); }
 
-// KD-tree node
+    float operator()(const float *query, size_t r) const
+    {
+        if constexpr (Half) {
+            return half(query, store->halfRow(r), store->dim());
+        }
+        else {
+            return pair(query, store->row(r));
+        }
+    }
+
+    float coordinate(size_t r, size_t d) const
+    {
+        if constexpr (Half) {
+            return store->coordinate(r, d);
+        }
+        else {
+            return store->row(r)[d];
+        }
+    }
+};
+
+/**
+ * @brief Calls fn(dist) with dist the StoreDistance of T over store.
+ *
+ * The kernels are picked here, once per search. For fp32 rows of
+ * std::array<float, N> with N >= 16, fn also runs compiled for the CPU's
+ * instruction set (withKernelIsa), so the distance is inlined into fn's
+ * loops rather than called through l2sqN on every evaluation; calls that fn
+ * makes to a recursive function still reach it directly but are not inlined.
+ * Other types use Embedding_T<T>::distance_sq. Half-precision rows go
+ * through l2sqF16 or l2sqBf16, with a single copy of fn.
+ */
+template <typename T, typename Fn>
+void withDistanceSq(const EmbeddingStore &store, Fn &&fn)
+{
+    auto pair = [](const float *a, const float *b) { return Embedding_T<T>::distance_sq(a, b); };
+    if (store.storage() != Storage::F32) {
+        // the rows go through l2sqF16 or l2sqBf16 anyway, so one copy of fn serves every instruction set
+        L2sqHalf half = store.storage() == Storage::F16 ? l2sqF16 : l2sqBf16;
+        fn(StoreDistance<decltype(pair), true>{pair, &store, half});
+    }
+    else if constexpr (kDispatchedDistance<T>) {
+        withKernelIsa([&](auto isa) {
+            auto pairIsa = [](const float *a, const float *b) {
+                return Embedding_T<T>::template distance_sq<decltype(isa)::value>(a, b);
+            };
+            fn(StoreDistance<decltype(pairIsa), false>{pairIsa, &store, nullptr});
+        });
+    }
+    else {
+        fn(StoreDistance<decltype(pair), false>{pair, &store, nullptr});
+    }
+}
+
+// KD-tree node (pointer-linked compatibility view, see toNodes)
 template <typename T>
 struct Node
 {
@@ -78,6 +478,343 @@ template <typename T>
 T Node<T>::queryEmbedding;
 
 
+// Flat KD-tree node: owns the store rows [row, row + count) and its children are
+// 32-bit indices into KDTree<T>::nodes, -1 if absent. An inner node holds just
+// its median point (count 1), which is also the split point, and its splitting
+// dimension; a leaf holds a bucket of up to leafSize points and has no children.
+// Kept at 16 bytes, four nodes to a cache line.
+struct KDNode
+{
+    int32_t row;
+    int32_t left = -1;
+    int32_t right = -1;
+    uint16_t axis = 0;
+    uint16_t count = 1;
+
+    bool isLeaf() const { return left < 0 && right < 0; }
+};
+static_assert(sizeof(KDNode) == 16);
+
+// KD-tree stored as one contiguous array of nodes in preorder (nodes[0] is the root),
+// so the whole tree is a single allocation and is released in O(1) with the vector.
+// The embeddings stay in the store, which must outlive the tree.
+template <typename T>
+struct KDTree
+{
+    const EmbeddingStore *store = nullptr;
+    std::vector<KDNode> nodes;
+    size_t leafSize = 1;
+
+    int32_t root() const { return nodes.empty() ? -1 : 0; }
+    size_t size() const { return nodes.size(); }
+};
+
+
+/**
+ * @brief Options for buildKDTree.
+ *
+ * With threads > 1 the two subtrees of a node are built by separate threads
+ * until the thread budget is split down to one or a subtree has fewer than
+ * serialCutoff points; from there on recursion is serial.
+ */
+struct BuildOptions
+{
+    unsigned threads = 1;
+    size_t serialCutoff = 1 << 14;
+    size_t leafSize = 1;     // ranges of at most this many points become one leaf bucket
+};
+
+// Largest bucket a KDNode can describe
+constexpr size_t kMaxLeafSize = UINT16_MAX;
+
+
+// Runs fn(t) for t in [0, threads), on threads - 1 new threads plus the caller.
+template <typename Fn>
+void parallelFor(unsigned threads, Fn &&fn)
+{
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    for (unsigned t = 1; t < threads; ++t) {
+        workers.emplace_back(fn, t);
+    }
+    fn(0u);
+    for (auto &w : workers) {
+        w.join();
+    }
+}
+
+/**
+ * Same contract as std::nth_element for a strict total order, with the
+ * partitioning steps spread over several threads. Each round picks a pivot from
+ * a sample, every thread counts and scatters its chunk around it into scratch,
+ * and the round continues on the side holding nth. Small ranges finish with
+ * std::nth_element. Only the partition of the range matters to the caller, so
+ * the result is the same as the serial selection.
+ */
+template <typename Less>
+void parallelNthElement(int32_t *first, int32_t *nth, int32_t *last,
+                        Less less, unsigned threads, size_t serialCutoff)
+{
+    std::vector<int32_t> scratch;
+    std::vector<size_t> below(threads);
+
+    while (threads > 1 && static_cast<size_t>(last - first) > serialCutoff) {
+        size_t n = last - first;
+
+        // pivot: median of an evenly spaced sample
+        int32_t sample[31];
+        for (size_t i = 0; i < 31; ++i) sample[i] = first[i * (n - 1) / 30];
+        std::nth_element(sample, sample + 15, sample + 31, less);
+        int32_t pivot = sample[15];
+
+        size_t chunk = (n + threads - 1) / threads;
+        auto chunkOf = [&](unsigned t) {
+            return std::pair(first + std::min(n, t * chunk), first + std::min(n, (t + 1) * chunk));
+        };
+
+        parallelFor(threads, [&](unsigned t) {
+            auto [b, e] = chunkOf(t);
+            below[t] = std::count_if(b, e, [&](int32_t r) { return less(r, pivot); });
+        });
+
+        size_t totalBelow = 0;
+        std::vector<size_t> lo(threads), hi(threads);
+        for (unsigned t = 0; t < threads; ++t) {
+            lo[t] = totalBelow;
+            totalBelow += below[t];
+        }
+        size_t above = totalBelow;
+        for (unsigned t = 0; t < threads; ++t) {
+            auto [b, e] = chunkOf(t);
+            hi[t] = above;
+            above += (e - b) - below[t];
+        }
+
+        scratch.resize(n);
+        parallelFor(threads, [&](unsigned t) {
+            auto [b, e] = chunkOf(t);
+            size_t l = lo[t], h = hi[t];
+            for (int32_t *it = b; it != e; ++it) {
+                scratch[less(*it, pivot) ? l++ : h++] = *it;
+            }
+        });
+        parallelFor(threads, [&](unsigned t) {
+            auto [b, e] = chunkOf(t);
+            std::copy(scratch.begin() + (b - first), scratch.begin() + (e - first), b);
+        });
+
+        // [first, first+totalBelow) < pivot <= the rest, and the pivot is in the rest
+        int32_t *split = first + totalBelow;
+        if (nth < split) {
+            last = split;
+        }
+        else {
+            // move the pivot to the front of the upper part, it is its minimum
+            std::iter_swap(split, std::find(split, last, pivot));
+            if (nth == split) return;
+            first = split + 1;
+        }
+    }
+    std::nth_element(first, nth, last, less);
+}
+
+
+/**
+ * Node counts of the subtrees of a k-d tree over n points.
+ *
+ * A range of m points splits into (m-1)/2 and m/2, so the ranges at one depth
+ * all hold s or s + 1 points for some s, and a tree has at most about
+ * 2·log2(n) distinct subtree sizes. Their node counts are worked out once,
+ * smallest first, so a builder looks a subtree's count up instead of
+ * recursing over it at every node.
+ */
+class SubtreeNodeCounts
+{
+public:
+    // leafSize >= 1: ranges of at most leafSize points are one leaf
+    SubtreeNodeCounts(size_t n, size_t leafSize)
+    {
+        std::vector<size_t> smallest{n};    // smallest range size at each depth
+        while (smallest.back() > 0 && smallest.back() + 1 > leafSize) {
+            smallest.push_back((smallest.back() - 1) / 2);
+        }
+        for (auto it = smallest.rbegin(); it != smallest.rend(); ++it) {
+            for (size_t m : {*it, *it + 1}) {
+                if (!counts_.empty() && counts_.back().first >= m) continue;
+                int32_t count = m == 0 ? 0 : m <= leafSize ? 1 : 1 + (*this)((m - 1) / 2) + (*this)(m / 2);
+                counts_.emplace_back(m, count);
+            }
+        }
+    }
+
+    // Number of nodes in a subtree of m points, m a range size of the tree.
+    int32_t operator()(size_t m) const
+    {
+        auto it = std::lower_bound(counts_.begin(), counts_.end(), std::pair<size_t, int32_t>(m, 0));
+        return it->second;
+    }
+
+private:
+    std::vector<std::pair<size_t, int32_t>> counts_;    // (subtree size, node count), ascending
+};
+
+// True if two of the rows in [first, last) have equal coordinates on axis.
+inline bool hasTiedCoordinate(const EmbeddingStore &store, const int32_t *first, const int32_t *last, int axis)
+{
+    size_t n = last - first;
+    if (n <= 32) {
+        for (const int32_t *a = first; a != last; ++a) {
+            for (const int32_t *b = a + 1; b != last; ++b) {
+                if (store.row(*a)[axis] == store.row(*b)[axis]) return true;
+            }
+        }
+        return false;
+    }
+    // open addressing over the coordinates' bit patterns, stored + 1 so 0 marks a free slot
+    thread_local std::vector<uint64_t> slots;
+    size_t mask = std::bit_ceil(2 * n) - 1;
+    slots.assign(mask + 1, 0);
+    for (const int32_t *it = first; it != last; ++it) {
+        float c = store.row(*it)[axis];
+        uint32_t bits = c == 0.0f ? 0 : std::bit_cast<uint32_t>(c);   // -0 == +0
+        uint64_t key = uint64_t(bits) + 1;
+        size_t i = (bits * 0x9E3779B97F4A7C15ull) >> 32 & mask;
+        for (; slots[i] != 0; i = (i + 1) & mask) {
+            if (slots[i] == key) return true;
+        }
+        slots[i] = key;
+    }
+    return false;
+}
+
+// Recursive step of buildKDTree: builds the subtree for the rows in [first, last)
+// of the permutation starting at base into tree.nodes[slot...] in preorder; node
+// rows are positions in that permutation. The left subtree of a range with n points
+// always holds (n-1)/2 of them, so each subtree's slots are known up front and
+// both halves can be filled concurrently.
+// The tree must be the one the original builder made by std::sort-ing every range
+// on its split coordinate and copying out the halves. When the coordinates of a
+// range are distinct the sorted order is unique, and the range is only partitioned
+// around its median with nth_element, in linear time. When some are tied, where
+// they land depends on std::sort's input order, so the range is sorted the same
+// way, on the same input: inSortOrder says the range already is in the order the
+// original builder gave it; otherwise the parent went through nth_element, its
+// coordinates are distinct here, and sorting on them brings that order back.
+// counts gives the node counts of the subtrees of the whole tree.
+template <typename T>
+void buildKD(KDTree<T> &tree, int32_t *base, int32_t *first, int32_t *last, int32_t slot,
+             int depth, unsigned threads, const BuildOptions &options, const SubtreeNodeCounts &counts,
+             bool inSortOrder = true)
+{
+    if (first == last) return;
+    KDNode &node = tree.nodes[slot];
+    size_t n = last - first;
+    if (n <= options.leafSize) {
+        node.row = static_cast<int32_t>(first - base);
+        node.count = static_cast<uint16_t>(n);
+        return;
+    }
+
+    int dims = static_cast<int>(Embedding_T<T>::Dim());
+    int axis = depth % dims;
+    const EmbeddingStore &store = *tree.store;
+    auto onAxis = [&store](int axis) {
+        return [axis, &store](int32_t a, int32_t b) { return store.row(a)[axis] < store.row(b)[axis]; };
+    };
+
+    // diff than part 1, we use depth 
+    int32_t *median = first + (n - 1) / 2;
+    bool tied = hasTiedCoordinate(store, first, last, axis);
+    if (tied) {
+        if (!inSortOrder) {
+            std::sort(first, last, onAxis((depth - 1) % dims));
+        }
+        std::sort(first, last, onAxis(axis));
+    }
+    else if (threads > 1) {
+        parallelNthElement(first, median, last, onAxis(axis), threads, options.serialCutoff);
+    }
+    else {
+        std::nth_element(first, median, last, onAxis(axis));
+    }
+
+    size_t leftSize = median - first;
+    node.row = static_cast<int32_t>(median - base);
+    node.axis = static_cast<uint16_t>(axis);
+    node.left = leftSize > 0 ? slot + 1 : -1;
+    node.right = median + 1 < last ? slot + 1 + counts(leftSize) : -1;
+
+    //build tree
+    if (threads > 1 && n > options.serialCutoff) {
+        unsigned leftThreads = threads / 2;
+        std::thread leftBuilder([&] {
+            buildKD(tree, base, first, median, node.left, depth + 1, leftThreads, options, counts, tied);
+        });
+        buildKD(tree, base, median + 1, last, node.right, depth + 1, threads - leftThreads, options, counts, tied);
+        leftBuilder.join();
+    }
+    else {
+        buildKD(tree, base, first, median, node.left, depth + 1, 1, options, counts, tied);
+        buildKD(tree, base, median + 1, last, node.right, depth + 1, 1, options, counts, tied);
+    }
+}
+
+/**
+ * Builds a flat KD-tree over every row of an embedding store.
+ * The splitting dimension is chosen based on the current depth; ranges of at
+ * most options.leafSize points become leaf buckets. All nodes live in a single
+ * array allocated up front. The store's rows are then reordered into tree
+ * order, so every node's points (and every leaf bucket) are contiguous rows.
+ * The tree is the same for any thread count.
+ *
+ * @param store The embeddings to index; reordered in place, it must outlive the tree.
+ * @param options Thread count, serial cutoff and leaf size of the build.
+ * @return The constructed KD-tree.
+ */
+template <typename T>
+KDTree<T> buildKDTree(EmbeddingStore &store, const BuildOptions &options = {})
+{
+    BuildOptions opts = options;
+    opts.threads = std::max(1u, opts.threads);
+    opts.leafSize = std::clamp<size_t>(opts.leafSize, 1, kMaxLeafSize);
+
+    KDTree<T> tree;
+    tree.store = &store;
+    tree.leafSize = opts.leafSize;
+    SubtreeNodeCounts counts(store.size(), opts.leafSize);
+    tree.nodes.resize(counts(store.size()));
+
+    std::vector<int32_t> rows(store.size());
+    for (size_t i = 0; i < rows.size(); ++i) rows[i] = static_cast<int32_t>(i);
+    buildKD(tree, rows.data(), rows.data(), rows.data() + rows.size(), 0, 0, opts.threads, opts, counts);
+    store.permute(rows);
+    return tree;
+}
+
+/**
+ * Converts a flat KD-tree with one point per node (leafSize 1) into the
+ * pointer-linked Node<T> representation. The nodes are allocated as one array in the same preorder layout, so the
+ * returned root owns the whole block and must be released with freeTree.
+ *
+ * @param tree The flat tree, embeddings are copied out of its store.
+ * @return A pointer to the root node, nullptr for an empty tree.
+ */
+template <typename T>
+Node<T>* toNodes(const KDTree<T> &tree)
+{
+    if (tree.nodes.empty()) return nullptr;
+
+    auto* block = new Node<T>[tree.nodes.size()];
+    for (size_t i = 0; i < tree.nodes.size(); ++i) {
+        auto& flat = tree.nodes[i];
+        block[i].embedding = fromRow<T>(tree.store->row(flat.row));
+        block[i].idx = tree.store->id(flat.row);
+        block[i].left = flat.left < 0 ? nullptr : block + flat.left;
+        block[i].right = flat.right < 0 ? nullptr : block + flat.right;
+    }
+    return block;
+}
+
 /**
  * Builds a KD-tree from a vector of items,
  * where each item consists of an embedding and its associated index.
@@ -89,49 +826,31 @@ T Node<T>::queryEmbedding;
  * @return A pointer to the root node of the constructed KD-tree.
  */
 // Build a balanced KD‐tree by splitting on median at each level.
-
-
-
 template <typename T>
 Node<T>* buildKD(std::vector<std::pair<T,int>>& items, int depth = 0)
 {
-    /*
-    TODO: Implement this function to build a balanced KD-tree.
-    You should recursively construct the tree and return the root node.
-    */
-
-    if (items.empty()) return nullptr;
-    int axis = depth % static_cast<int>(Embedding_T<T>::Dim());
-
-    // diff than part 1, we use depth 
-    sort(items.begin(), items.end(),
-		[&axis](auto& a, auto& b){
-			return (getCoordinate(a.first, axis) < getCoordinate(b.first, axis));
-		});
-    
-
-    int n = items.size();
+    EmbeddingStore store(Embedding_T<T>::Dim());
+    store.reserve(items.size());
+    for (const auto& item : items) {
+        const float *src = coords(item.first);
+        std::copy(src, src + store.dim(), store.append(item.second));
+    }
 
-    int medianIndex = (n-1)/2;
-    
-    auto leftTree = std::vector(items.begin(), items.begin()+medianIndex);
-    auto rightTree = std::vector(items.begin()+medianIndex+1, items.end());
-    
-    auto* root = new Node{items[medianIndex].first, items[medianIndex].second};
-    
-    //build tree
-    root->left = buildKD(leftTree, depth + 1);
-    root->right = buildKD(rightTree, depth + 1);
-    
-    return root;
+    KDTree<T> tree;
+    tree.store = &store;
+    tree.nodes.resize(store.size());
+    std::vector<int32_t> rows(store.size());
+    for (size_t i = 0; i < rows.size(); ++i) rows[i] = static_cast<int32_t>(i);
+    buildKD(tree, rows.data(), rows.data(), rows.data() + rows.size(), 0, depth, 1, BuildOptions{},
+            SubtreeNodeCounts(store.size(), 1));
+    store.permute(rows);
+    return toNodes(tree);
 }
 
+// Releases a tree returned by buildKD; the nodes form a single block owned by the root.
 template <typename T>
 void freeTree(Node<T> *node) {
-    if (!node) return;
-    freeTree(node->left);
-    freeTree(node->right);
-    delete node;
+    delete[] node;
 }
 
 /**
@@ -161,28 +880,22 @@ using MaxHeap = std::priority_queue<
  *
  * This function recursively traverses the KD-tree starting from the given node,
  * searching for the K nearest neighbors to a target point. The results are maintained
- * in a max-heap, and an optional epsilon parameter can be used to allow for approximate
- * nearest neighbor search.
+ * in a max-heap. The search is exact; approximate search (SearchOptions::eps) is
+ * available on the flat KDTree<T>.
  *
  * @param node Pointer to the current node in the KD-tree.
+ * @param query The query embedding.
  * @param depth Current depth in the KD-tree (used to determine splitting axis).
  * @param K Number of nearest neighbors to search for.
- * @param epsilon Approximation factor for the search (0 for exact search).
  * @param heap Reference to a max-heap that stores the current K nearest neighbors found.
  */
 template <typename T>
 void knnSearch(Node<T> *node,
+               const T &query,
                int depth,
                int K,
                MaxHeap &heap)
 {
-    /*
-    TODO: Implement this function to perform k-nearest neighbors (k-NN) search on the KD-tree.
-    You should recursively traverse the tree and maintain a max-heap of the K closest points found so far.
-    For now, this is a stub that does nothing.
-    */
-
-
    if (node==nullptr){
         return;
    }
@@ -190,13 +903,13 @@ void knnSearch(Node<T> *node,
     // size_t my_size = Embedding_T<T>::Dim();
     int axis = depth %  static_cast<int> (Embedding_T<T>::Dim());
 
-    //Compare the query point (Node<T>::queryEmbedding) to the current node’s point along the splitting axis.
-    if (getCoordinate(Node<T>::queryEmbedding, axis) < getCoordinate(node->embedding, axis)){
-        knnSearch(node->left, depth+1,K, heap);
+    //Compare the query point to the current node’s point along the splitting axis.
+    if (getCoordinate(query, axis) < getCoordinate(node->embedding, axis)){
+        knnSearch(node->left, query, depth+1, K, heap);
     }
         
     else{
-        knnSearch(node->right, depth+1,K, heap);
+        knnSearch(node->right, query, depth+1, K, heap);
     }
 
     //now heap is updated w closer tree candidates
@@ -204,29 +917,744 @@ void knnSearch(Node<T> *node,
 
     if (heap.size()< static_cast<size_t>(K)){
         // heap.push({node->embedding::distance(Node<T>::queryEmbedding, node->embedding), node->idx});
-        heap.push({Embedding_T<T>::distance(Node<T>::queryEmbedding, node->embedding), node->idx});
+        heap.push({Embedding_T<T>::distance(query, node->embedding), node->idx});
     }
-    else if (Embedding_T<T>::distance(Node<T>::queryEmbedding, node->embedding) < heap.top().first){
+    else if (Embedding_T<T>::distance(query, node->embedding) < heap.top().first){
         heap.pop();
-        heap.push({Embedding_T<T>::distance(Node<T>::queryEmbedding, node->embedding), node->idx});
+        heap.push({Embedding_T<T>::distance(query, node->embedding), node->idx});
     }
 
     //if current node is not the worst node on the heap then we can't prune 
     //because something could still beat the worst node -- explore other
     //or if we still need to add candidates
 
-    float planeDist = std::abs(getCoordinate(Node<T>::queryEmbedding, axis)-getCoordinate(node->embedding, axis));
+    float planeDist = std::abs(getCoordinate(query, axis)-getCoordinate(node->embedding, axis));
 
     // if (heap.size()< static_cast<size_t>(K) || distance(heap.top().first, Node::queryEmbedding)> planeDist){
 
     if (heap.size()< static_cast<size_t>(K) || heap.top().first > planeDist){
 
-        if (getCoordinate(Node<T>::queryEmbedding, axis) < getCoordinate(node->embedding, axis)){
-            knnSearch(node->right, depth+1, K,heap);
+        if (getCoordinate(query, axis) < getCoordinate(node->embedding, axis)){
+            knnSearch(node->right, query, depth+1, K, heap);
         }
         else{
-            knnSearch(node->left, depth+1, K, heap);
+            knnSearch(node->left, query, depth+1, K, heap);
         }
     }
     return;
-}
\ No newline at end of file
+}
+
+// Searches for Node<T>::queryEmbedding; a thin wrapper over the reentrant overload.
+template <typename T>
+void knnSearch(Node<T> *node,
+               int depth,
+               int K,
+               MaxHeap &heap)
+{
+    knnSearch(node, Node<T>::queryEmbedding, depth, K, heap);
+}
+
+/**
+ * @brief Bounded max-heap holding the K best (distance, id) pairs seen so far.
+ *
+ * Storage is allocated once for the largest K used and reused across
+ * queries. Once full, a better candidate overwrites the root and is sifted
+ * down in a single pass, instead of a pop followed by a push. worst() caches
+ * the root distance for pruning tests (infinity until K items are held), so
+ * "still filling or closer than the worst" collapses to one comparison.
+ * Candidates are ordered by (distance, id), so the result does not depend
+ * on visiting order.
+ */
+class TopK
+{
+public:
+    explicit TopK(int K = 0) { reset(K); }
+
+    // Empties the container for a new query of K results, keeping the storage
+    void reset(int K)
+    {
+        k_ = std::max(0, K);
+        if (items_.size() < static_cast<size_t>(k_)) {
+            items_.resize(k_);
+        }
+        size_ = 0;
+        worst_ = std::numeric_limits<float>::infinity();
+    }
+
+    int size() const { return size_; }
+    float worst() const { return worst_; }
+
+    void offer(float dist, int idx)
+    {
+        PQItem item{dist, idx};
+        if (size_ < k_) {
+            // sift up from the new leaf
+            int i = size_++;
+            while (i > 0 && items_[(i - 1) / 2] < item) {
+                items_[i] = items_[(i - 1) / 2];
+                i = (i - 1) / 2;
+            }
+            items_[i] = item;
+            if (size_ == k_) {
+                worst_ = items_[0].first;
+            }
+        }
+        else if (k_ > 0 && item < items_[0]) {
+            // replace top: sift the hole at the root down
+            int i = 0;
+            for (;;) {
+                int c = 2 * i + 1;
+                if (c >= size_) break;
+                if (c + 1 < size_ && items_[c] < items_[c + 1]) ++c;
+                if (!(item < items_[c])) break;
+                items_[i] = items_[c];
+                i = c;
+            }
+            items_[i] = item;
+            worst_ = items_[0].first;
+        }
+    }
+
+    // Sorts the held items ascending in place and returns them; call reset() before reuse
+    std::span<const PQItem> sorted()
+    {
+        std::sort_heap(items_.begin(), items_.begin() + size_);
+        return {items_.data(), static_cast<size_t>(size_)};
+    }
+
+private:
+    std::vector<PQItem> items_;
+    int k_ = 0;
+    int size_ = 0;
+    float worst_ = 0;
+};
+
+/**
+ * @brief Top-K container for K <= N kept as a sorted array.
+ *
+ * For the small K of interactive queries, insertion into a sorted array of at
+ * most N items beats heap sifting, needs no allocation, and extraction is free.
+ * Same interface and ordering as TopK.
+ */
+template <int N>
+class SortedTopK
+{
+public:
+    explicit SortedTopK(int K = 0) { reset(K); }
+
+    void reset(int K)
+    {
+        k_ = std::clamp(K, 0, N);
+        size_ = 0;
+        worst_ = std::numeric_limits<float>::infinity();
+    }
+
+    int size() const { return size_; }
+    float worst() const { return worst_; }
+
+    void offer(float dist, int idx)
+    {
+        PQItem item{dist, idx};
+        if (size_ == k_) {
+            if (k_ == 0 || !(item < items_[size_ - 1])) return;
+            --size_;
+        }
+        int i = size_++;
+        while (i > 0 && item < items_[i - 1]) {
+            items_[i] = items_[i - 1];
+            --i;
+        }
+        items_[i] = item;
+        if (size_ == k_) {
+            worst_ = items_[size_ - 1].first;
+        }
+    }
+
+    std::span<const PQItem> sorted() const { return {items_.data(), static_cast<size_t>(size_)}; }
+
+private:
+    std::array<PQItem, N> items_;
+    int k_ = 0;
+    int size_ = 0;
+    float worst_ = 0;
+};
+
+// Largest K answered with SortedTopK; larger K use the TopK heap
+constexpr int kSmallK = 16;
+
+/**
+ * @brief Parameters of a flat-tree search.
+ *
+ * With eps > 0 the search is (1 + eps)-approximate: a subtree is skipped
+ * unless its cell is closer than the K-th best distance divided by (1 + eps),
+ * so the i-th reported neighbor is at most (1 + eps) times farther than the
+ * true i-th nearest one. Larger eps visits fewer nodes at lower recall.
+ *
+ * maxChecks bounds the distance evaluations of knnSearchBestBin (0 = no limit).
+ * rerank is the number of candidates a quantized search re-ranks with exact
+ * distances (only used when larger than K).
+ */
+struct SearchOptions
+{
+    float eps = 0.0f;
+    size_t maxChecks = 0;
+    size_t rerank = 0;
+
+    // Factor applied to squared cell distances before the pruning test
+    float pruneScale() const { return (1.0f + eps) * (1.0f + eps); }
+};
+
+/**
+ * @brief Caller-owned state of one search over an immutable index.
+ *
+ * Searches keep everything they write here, so a tree can be searched by any
+ * number of threads at once as long as each one uses its own context.
+ * A context can be reused across queries, and its storage is kept between them.
+ */
+struct SearchContext
+{
+    // A subtree waiting in the best-bin-first queue
+    struct Branch
+    {
+        float cellDistSq;   // squared distance from the query to the subtree's cell
+        int32_t node;
+        int32_t link;       // last entry of the cell's offset chain in links, -1 for none
+        int32_t tree;       // which of the searched trees node belongs to
+
+        bool operator>(const Branch &o) const { return cellDistSq > o.cellDistSq; }
+    };
+    // One axis offset of a queued cell; the chain through parent lists every
+    // axis on which the cell lies outside the query's side (all others are 0)
+    struct OffsetLink
+    {
+        int32_t axis;
+        float offset;
+        int32_t parent;
+    };
+
+    SortedTopK<kSmallK> small;       // best candidates when K <= kSmallK
+    TopK heap;                       // best candidates otherwise
+    std::span<const PQItem> results; // the last search's (squared distance, id) pairs, ascending
+    std::vector<float> offsets;      // per axis, how far the query lies outside the current cell
+    std::vector<Branch> branches;    // best-bin-first min-heap
+    std::vector<OffsetLink> links;   // offset chains of the queued cells
+    TopK beam;                       // graph searches: the ef closest (distance, row) pairs found
+    std::vector<PQItem> frontier;    // graph searches: min-heap of (distance, row) still to expand
+    std::vector<int32_t> rowBuf;     // graph searches: the adjacency list being expanded
+    std::vector<float> table;        // quantized searches: per-query lookup table or weights
+    std::vector<int16_t> weights;    // scalar-quantized searches: the query's rounded weights
+    std::vector<uint64_t> queryBits; // binary searches: the query's sign bits
+    std::vector<uint32_t> rowDist;   // binary searches: Hamming distance of every row
+    std::vector<uint32_t> histogram; // binary searches: number of rows at each Hamming distance
+    std::vector<uint32_t> seen;      // seen[row] == epoch once the current search evaluated row
+    uint32_t epoch = 0;
+    size_t nodesVisited = 0;         // nodes the last search entered, leaves included
+    size_t checks = 0;               // distances the last search evaluated
+
+    // Prepares the per-query scratch for a Dim()-dimensional search
+    void start(size_t dim)
+    {
+        offsets.assign(dim, 0.0f);
+        branches.clear();
+        links.clear();
+        nodesVisited = 0;
+        checks = 0;
+    }
+
+    // Forgets the rows seen so far, for a store of n rows; O(1) except on the first call and every 2^32 searches
+    void beginSeen(size_t n)
+    {
+        if (seen.size() < n) {
+            seen.assign(n, 0);
+            epoch = 0;
+        }
+        if (++epoch == 0) {
+            std::fill(seen.begin(), seen.end(), 0);
+            epoch = 1;
+        }
+    }
+
+    // Marks row as seen; false if it already was during the current search
+    bool markSeen(int32_t row)
+    {
+        if (seen[row] == epoch) return false;
+        seen[row] = epoch;
+        return true;
+    }
+};
+
+/**
+ * Recursive step of the flat-tree search, see knnSearch(tree, query, K, ctx).
+ *
+ * Pruning uses the incremental distance of Arya and Mount: cellDistSq is the
+ * squared distance from the query to the node's cell and offsets[a] the
+ * query's distance to the cell along axis a. The near child shares both with
+ * its parent; for the far child only the split axis changes, to the plane
+ * distance, so its cell distance is cellDistSq - offsets[a]^2 + planeDist^2.
+ * That bound is never looser than planeDist^2 alone and far tighter in many
+ * dimensions, and it is a true lower bound, so results stay exact. Cell
+ * distances are multiplied by scale (SearchOptions::pruneScale) before the
+ * test, 1 for an exact search. dist is the search's StoreDistance, see
+ * withDistanceSq.
+ */
+template <typename T, typename Top, typename Dist>
+void knnSearch(const KDTree<T> &tree,
+               int32_t node,
+               int depth,
+               const float *query,
+               float cellDistSq,
+               float *offsets,
+               float scale,
+               Top &top,
+               size_t &visited,
+               const Dist &dist)
+{
+    if (node < 0) {
+        return;
+    }
+    ++visited;
+
+    const KDNode &cur = tree.nodes[node];
+    const EmbeddingStore &store = *tree.store;
+
+    if (cur.isLeaf()) {
+        for (int32_t r = cur.row; r < cur.row + cur.count; ++r) {
+            top.offer(dist(query, r), store.id(r));
+        }
+        return;
+    }
+
+    int axis = depth % static_cast<int>(Embedding_T<T>::Dim());
+    float split = dist.coordinate(cur.row, axis);
+
+    bool goLeft = query[axis] < split;
+    knnSearch(tree, goLeft ? cur.left : cur.right, depth + 1, query, cellDistSq, offsets, scale, top, visited, dist);
+
+    top.offer(dist(query, cur.row), store.id(cur.row));
+
+    // ties with the worst distance are explored, they may still win on id
+    float planeDist = query[axis] - split;
+    float oldOffset = offsets[axis];
+    float farDistSq = cellDistSq - oldOffset * oldOffset + planeDist * planeDist;
+    if (farDistSq * scale <= top.worst()) {
+        offsets[axis] = std::abs(planeDist);
+        knnSearch(tree, goLeft ? cur.right : cur.left, depth + 1, query, farDistSq, offsets, scale, top, visited, dist);
+        offsets[axis] = oldOffset;
+    }
+}
+
+/**
+ * @brief Performs a k-nearest neighbors (k-NN) search on a flat KD-tree.
+ *
+ * Same traversal as the Node<T> overload, with children followed by index.
+ * Leaf buckets are scanned linearly over their contiguous store rows, and a
+ * subtree is skipped once its whole cell is farther than the K-th best so far.
+ * The whole search runs on squared distances (Embedding_T<T>::distance_sq),
+ * so ctx.results holds squared distances; take the square root of the
+ * K results only when reporting them. Types whose distance kernel is picked
+ * at run time (see withDistanceSq) take the equivalent knnSearchIterative
+ * path, since the kernel cannot be inlined into a recursion.
+ *
+ * Reentrant: the tree is only read and all state lives in ctx, so concurrent
+ * searches on one tree need no locking.
+ *
+ * @param tree The flat KD-tree.
+ * @param query The query, Dim() contiguous floats.
+ * @param K Number of nearest neighbors to search for.
+ * @param ctx Caller-owned context; ctx.results receives the neighbors, valid until its next search.
+ * @param options Approximation settings, exact by default.
+ */
+template <typename T>
+void knnSearch(const KDTree<T> &tree, const float *query, int K, SearchContext &ctx,
+               const SearchOptions &options = {})
+{
+    ctx.start(Embedding_T<T>::Dim());
+    if constexpr (kDispatchedDistance<T>) {
+        knnSearchIterative(tree, query, K, ctx, options);
+        return;
+    }
+    withDistanceSq<T>(*tree.store, [&](auto dist) {
+        if (K <= kSmallK) {
+            ctx.small.reset(K);
+            knnSearch(tree, tree.root(), 0, query, 0.0f, ctx.offsets.data(), options.pruneScale(),
+                      ctx.small, ctx.nodesVisited, dist);
+            ctx.results = ctx.small.sorted();
+        }
+        else {
+            ctx.heap.reset(K);
+            knnSearch(tree, tree.root(), 0, query, 0.0f, ctx.offsets.data(), options.pruneScale(),
+                      ctx.heap, ctx.nodesVisited, dist);
+            ctx.results = ctx.heap.sorted();
+        }
+    });
+}
+
+/**
+ * @brief Non-recursive k-NN search on a flat KD-tree, a drop-in alternative to knnSearch.
+ *
+ * Visits nodes in exactly the order of the recursive search and returns the
+ * same results. Descending to a leaf pushes one (node, plane distance, cell
+ * distance) entry per inner node on the path onto a fixed-size stack; popping
+ * an entry offers the node's own point and then descends the far side if its
+ * cell is still within the worst distance. Far descents change one offset
+ * each and record the old value on a trail, which popping unwinds, so the
+ * offsets always describe the cell being searched. The split axis is read
+ * from the node instead of computing depth % Dim(), and the far child is
+ * prefetched while the near side is searched.
+ *
+ * @param tree The flat KD-tree.
+ * @param query The query, Dim() contiguous floats.
+ * @param offsets Dim() zeros; left zeroed on return.
+ * @param scale Factor on squared cell distances before pruning, see SearchOptions.
+ * @param top Empty top-K container (TopK or SortedTopK) that receives the results.
+ * @param visited Incremented for every node entered.
+ * @param dist The search's StoreDistance, see withDistanceSq.
+ */
+template <typename T, typename Top, typename Dist>
+void knnSearchIterative(const KDTree<T> &tree, const float *query, float *offsets, float scale,
+                        Top &top, size_t &visited, Dist dist)
+{
+    struct Entry
+    {
+        int32_t node;
+        float planeDist;   // signed, query minus split coordinate
+        float cellDistSq;  // squared distance from the query to the node's cell
+        int trail;         // trail height when the node was reached
+    };
+    // offsets[axis] before a far descent changed it
+    struct Undo
+    {
+        int axis;
+        float offset;
+    };
+    // a median split tree over int32 rows is at most 32 levels deep
+    Entry stack[64];
+    Undo trail[64];
+    int sp = 0, tp = 0;
+
+    const KDNode *nodes = tree.nodes.data();
+    const EmbeddingStore &store = *tree.store;
+
+    int32_t node = tree.root();
+    float cellDistSq = 0.0f;
+    for (;;) {
+        // walk the near side down to a leaf, stacking every inner node passed;
+        // near children share their parent's cell distance and offsets
+        while (node >= 0) {
+            ++visited;
+            const KDNode &cur = nodes[node];
+            if (cur.isLeaf()) {
+                for (int32_t r = cur.row; r < cur.row + cur.count; ++r) {
+                    top.offer(dist(query, r), store.id(r));
+                }
+                break;
+            }
+            float diff = query[cur.axis] - dist.coordinate(cur.row, cur.axis);
+            int32_t near = diff < 0 ? cur.left : cur.right;
+            int32_t far = diff < 0 ? cur.right : cur.left;
+            if (far >= 0) {
+                __builtin_prefetch(nodes + far);
+            }
+            stack[sp++] = {node, diff, cellDistSq, tp};
+            node = near;
+        }
+
+        // unwind to the next node whose far cell is still within reach
+        node = -1;
+        while (sp > 0 && node < 0) {
+            Entry e = stack[--sp];
+            // restore the offsets of e's cell
+            while (tp > e.trail) {
+                --tp;
+                offsets[trail[tp].axis] = trail[tp].offset;
+            }
+            const KDNode &cur = nodes[e.node];
+            top.offer(dist(query, cur.row), store.id(cur.row));
+
+            float oldOffset = offsets[cur.axis];
+            float farDistSq = e.cellDistSq - oldOffset * oldOffset + e.planeDist * e.planeDist;
+            // ties with the worst distance are explored, they may still win on id
+            if (farDistSq * scale <= top.worst()) {
+                node = e.planeDist < 0 ? cur.right : cur.left;
+                if (node >= 0) {
+                    trail[tp++] = {cur.axis, oldOffset};
+                    offsets[cur.axis] = std::abs(e.planeDist);
+                    cellDistSq = farDistSq;
+                }
+            }
+        }
+        if (node < 0 && sp == 0) break;
+    }
+
+    // leave offsets all zero again for the next query
+    while (tp > 0) {
+        --tp;
+        offsets[trail[tp].axis] = trail[tp].offset;
+    }
+}
+
+// Iterative counterpart of knnSearch(tree, query, K, ctx), with the same results.
+template <typename T>
+void knnSearchIterative(const KDTree<T> &tree, const float *query, int K, SearchContext &ctx,
+                        const SearchOptions &options = {})
+{
+    ctx.start(Embedding_T<T>::Dim());
+    withDistanceSq<T>(*tree.store, [&](auto dist) {
+        if (K <= kSmallK) {
+            ctx.small.reset(K);
+            knnSearchIterative(tree, query, ctx.offsets.data(), options.pruneScale(), ctx.small,
+                               ctx.nodesVisited, dist);
+            ctx.results = ctx.small.sorted();
+        }
+        else {
+            ctx.heap.reset(K);
+            knnSearchIterative(tree, query, ctx.offsets.data(), options.pruneScale(), ctx.heap,
+                               ctx.nodesVisited, dist);
+            ctx.results = ctx.heap.sorted();
+        }
+    });
+}
+
+/**
+ * @brief One k-d tree as seen by the best-bin-first search.
+ *
+ * Node rows index the tree's row order: the store row of position r is
+ * order[r], or r itself when order is null (a KDTree, whose store is
+ * permuted into tree order).
+ */
+struct TreeView
+{
+    const KDNode *nodes = nullptr;
+    const int32_t *order = nullptr;
+    int32_t root = -1;
+
+    int32_t storeRow(int32_t r) const { return order ? order[r] : r; }
+};
+
+/**
+ * @brief Best-bin-first search over one or more k-d trees on a shared store.
+ *
+ * Keeps the unexplored far children of all trees in one min-heap on their
+ * cell distance, so the trees compete for a single budget. Each round pops
+ * the closest cell and walks its near path to a leaf, evaluating every point
+ * passed and queueing each far child whose cell is still within reach. Cell
+ * distances are incremental as in knnSearch; the offset of a queued cell
+ * along the split axis is found by walking its link chain, which is no
+ * longer than the number of far turns on its path. With several trees a
+ * point can be reached more than once; it is evaluated only the first time.
+ *
+ * @param trees The trees to search, each over store.
+ * @param store The shared embedding store.
+ * @param query The query, Dim() contiguous floats.
+ * @param scale Factor on squared cell distances before pruning, see SearchOptions.
+ * @param maxChecks Distance evaluations after which the search stops, 0 for none.
+ * @param top Empty top-K container that receives the results.
+ * @param ctx Scratch queue, links, seen rows and counters; start() must have been called.
+ * @param dist The search's StoreDistance, see withDistanceSq.
+ */
+template <typename T, typename Top, typename Dist>
+void bestBinFirst(std::span<const TreeView> trees, const EmbeddingStore &store, const float *query,
+                  float scale, size_t maxChecks, Top &top, SearchContext &ctx, Dist dist)
+{
+    using Branch = SearchContext::Branch;
+    std::vector<Branch> &queue = ctx.branches;
+    std::vector<SearchContext::OffsetLink> &links = ctx.links;
+    size_t budget = maxChecks > 0 ? maxChecks : SIZE_MAX;
+    bool dedupe = trees.size() > 1;
+    if (dedupe) {
+        ctx.beginSeen(store.size());
+    }
+
+    auto offsetAlong = [&](int32_t link, int axis) {
+        for (; link >= 0; link = links[link].parent) {
+            if (links[link].axis == axis) return links[link].offset;
+        }
+        return 0.0f;
+    };
+    auto check = [&](int32_t row) {
+        if (dedupe && !ctx.markSeen(row)) return;
+        top.offer(dist(query, row), store.id(row));
+        ++ctx.checks;
+    };
+
+    for (size_t t = 0; t < trees.size(); ++t) {
+        if (trees[t].root >= 0) {
+            queue.push_back({0.0f, trees[t].root, -1, static_cast<int32_t>(t)});
+        }
+    }
+    std::make_heap(queue.begin(), queue.end(), std::greater<Branch>());
+
+    while (!queue.empty() && ctx.checks < budget) {
+        std::pop_heap(queue.begin(), queue.end(), std::greater<Branch>());
+        Branch b = queue.back();
+        queue.pop_back();
+        // every remaining cell is at least this far
+        if (b.cellDistSq * scale > top.worst()) break;
+
+        const TreeView &tree = trees[b.tree];
+        int32_t node = b.node;
+        while (node >= 0 && ctx.checks < budget) {
+            ++ctx.nodesVisited;
+            const KDNode &cur = tree.nodes[node];
+            if (cur.isLeaf()) {
+                for (int32_t r = cur.row; r < cur.row + cur.count; ++r) {
+                    check(tree.storeRow(r));
+                }
+                break;
+            }
+            int32_t row = tree.storeRow(cur.row);
+            check(row);
+
+            float diff = query[cur.axis] - dist.coordinate(row, cur.axis);
+            int32_t near = diff < 0 ? cur.left : cur.right;
+            int32_t far = diff < 0 ? cur.right : cur.left;
+            if (far >= 0) {
+                float oldOffset = offsetAlong(b.link, cur.axis);
+                float farDistSq = b.cellDistSq - oldOffset * oldOffset + diff * diff;
+                if (farDistSq * scale <= top.worst()) {
+                    links.push_back({cur.axis, std::abs(diff), b.link});
+                    queue.push_back({farDistSq, far, static_cast<int32_t>(links.size() - 1), b.tree});
+                    std::push_heap(queue.begin(), queue.end(), std::greater<Branch>());
+                }
+            }
+            node = near;
+        }
+    }
+}
+
+/**
+ * @brief Best-bin-first k-NN search with an optional budget of distance evaluations.
+ *
+ * Explores the tree cell by cell in order of distance to the query rather
+ * than depth first, so the cells most likely to hold neighbors come first.
+ * With options.maxChecks > 0 the search stops once that many distances have
+ * been evaluated (a leaf bucket is always finished, so it may run over by
+ * less than the leaf size), which caps per-query latency whatever the data;
+ * the results are then approximate. Without a budget it is exact (up to eps)
+ * and returns the same neighbors as knnSearch.
+ *
+ * @param tree The flat KD-tree.
+ * @param query The query, Dim() contiguous floats.
+ * @param K Number of nearest neighbors to search for.
+ * @param ctx Caller-owned context; ctx.results receives the neighbors, valid until its next search.
+ * @param options eps and the maxChecks budget.
+ */
+template <typename T>
+void knnSearchBestBin(const KDTree<T> &tree, const float *query, int K, SearchContext &ctx,
+                      const SearchOptions &options = {})
+{
+    TreeView view{tree.nodes.data(), nullptr, tree.root()};
+    std::span<const TreeView> trees(&view, 1);
+    ctx.start(Embedding_T<T>::Dim());
+    withDistanceSq<T>(*tree.store, [&](auto dist) {
+        if (K <= kSmallK) {
+            ctx.small.reset(K);
+            bestBinFirst<T>(trees, *tree.store, query, options.pruneScale(), options.maxChecks, ctx.small, ctx, dist);
+            ctx.results = ctx.small.sorted();
+        }
+        else {
+            ctx.heap.reset(K);
+            bestBinFirst<T>(trees, *tree.store, query, options.pruneScale(), options.maxChecks, ctx.heap, ctx, dist);
+            ctx.results = ctx.heap.sorted();
+        }
+    });
+}
+
+/**
+ * @brief Results of a batch of queries, stored by query index.
+ *
+ * Query q owns the K slots items[q*K ...]; the first count[q] of them hold its
+ * neighbors as (distance, id), ascending.
+ */
+struct BatchResults
+{
+    int K = 0;
+    std::vector<PQItem> items;
+    std::vector<int32_t> count;
+    std::vector<double> latencyUs;   // time spent on each query, in microseconds
+
+    const PQItem *neighbors(size_t q) const { return &items[q * K]; }
+};
+
+/**
+ * @brief Answers a batch of queries on the pool's workers with any engine.
+ *
+ * Queries are handed out in small chunks and balanced by work stealing. Every
+ * worker searches with its own SearchContext and writes into the slots of the
+ * query it is answering, so no two workers touch the same memory.
+ *
+ * @param queries nq queries of dim contiguous floats each.
+ * @param nq Number of queries.
+ * @param dim Floats per query.
+ * @param K Number of nearest neighbors per query.
+ * @param pool Worker threads to run on.
+ * @param out Receives the results; resized to fit the batch.
+ * @param search Callable (const float *query, SearchContext &ctx) leaving the
+ *               query's (squared distance, id) neighbors in ctx.results.
+ * @param report Callable (const float *query, float key) turning a ctx.results
+ *               key into the distance stored in out.
+ */
+template <typename Search, typename Report>
+void searchBatch(const float *queries, size_t nq, size_t dim, int K,
+                 WorkStealingPool &pool, BatchResults &out, Search search, Report report)
+{
+    out.K = K;
+    out.items.assign(nq * K, PQItem{});
+    out.count.assign(nq, 0);
+    out.latencyUs.assign(nq, 0.0);
+
+    // one context per worker, each on its own cache lines
+    struct alignas(64) WorkerScratch { SearchContext ctx; };
+    std::vector<WorkerScratch> scratch(pool.size());
+
+    pool.parallelFor(nq, 16, [&](unsigned worker, size_t begin, size_t end) {
+        SearchContext &ctx = scratch[worker].ctx;
+        for (size_t q = begin; q < end; ++q) {
+            auto start = std::chrono::high_resolution_clock::now();
+            search(queries + q * dim, ctx);
+            PQItem *slot = &out.items[q * K];
+            for (size_t i = 0; i < ctx.results.size(); ++i) {
+                slot[i] = {report(queries + q * dim, ctx.results[i].first), ctx.results[i].second};
+            }
+            out.count[q] = static_cast<int32_t>(ctx.results.size());
+            std::chrono::duration<double, std::micro> us = std::chrono::high_resolution_clock::now() - start;
+            out.latencyUs[q] = us.count();
+        }
+    });
+}
+
+// searchBatch reporting Euclidean distances: the square roots of the keys
+template <typename Search>
+void searchBatch(const float *queries, size_t nq, size_t dim, int K,
+                 WorkStealingPool &pool, BatchResults &out, Search search)
+{
+    searchBatch(queries, nq, dim, K, pool, out, search,
+                [](const float *, float key) { return std::sqrt(key); });
+}
+
+/**
+ * @brief Answers a batch of queries on a flat KD-tree.
+ *
+ * Uses knnSearchBestBin when options.maxChecks is set, knnSearch otherwise.
+ *
+ * @param tree The flat KD-tree.
+ * @param queries nq queries of Dim() contiguous floats each.
+ * @param nq Number of queries.
+ * @param K Number of nearest neighbors per query.
+ * @param pool Worker threads to run on.
+ * @param out Receives the results; resized to fit the batch.
+ * @param options Search settings shared by all queries.
+ */
+template <typename T>
+void searchBatch(const KDTree<T> &tree, const float *queries, size_t nq, int K,
+                 WorkStealingPool &pool, BatchResults &out, const SearchOptions &options = {})
+{
+    searchBatch(queries, nq, Embedding_T<T>::Dim(), K, pool, out, [&](const float *query, SearchContext &ctx) {
+        if (options.maxChecks > 0) {
+            knnSearchBestBin(tree, query, K, ctx, options);
+        }
+        else {
+            knnSearch(tree, query, K, ctx, options);
+        }
+    });
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+// Prints the mean and nearest-rank percentiles of per-query latencies in microseconds.
+inline void printLatencySummary(std::vector<double> us)
+{
+    if (us.empty()) return;
+    std::sort(us.begin(), us.end());
+    double sum = 0;
+    for (double u : us) sum += u;
+    auto pct = [&](double p) {
+        size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * us.size()));
+        return us[std::max<size_t>(rank, 1) - 1];
+    };
+    std::cout << "Latency (us): mean " << sum / us.size()
+              << ", p50 " << pct(50) << ", p90 " << pct(90)
+              << ", p99 " << pct(99) << ", max " << us.back() << "\n";
+}
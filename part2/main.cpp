@@ -1,12 +1,275 @@
 #include "knn.hpp"
+#include "forest.hpp"
+#include "hnsw.hpp"
+#include "ivf.hpp"
+#include "pq.hpp"
+#include "sq8.hpp"
+#include "binary.hpp"
+#include "metric.hpp"
+#include "gemm.hpp"
+#include "latency.hpp"
 #include <iostream>
 #include <fstream>
 #include <nlohmann/json.hpp>
 
 using json = nlohmann::json;
 
+// Index answering the queries
+enum class Engine
+{
+    KDTree,     // exact k-d tree (best-bin-first with --max-checks)
+    Forest,     // randomized k-d forest (best-bin-first, kForestChecks unless --max-checks)
+    Hnsw,       // HNSW graph
+    Ivf,        // inverted file over k-means lists
+    Pq,         // product-quantized codes
+    Sq8,        // int8 scalar-quantized codes
+    Binary,     // sign-bit Hamming prefilter + exact re-ranking
+    Scan,       // exact scan under any metric (--metric)
+    Gemm,       // exact blocked brute force by matrix products
+};
+
+// Name used in the metrics output
+const char *engineName(Engine engine)
+{
+    switch (engine) {
+    case Engine::Forest: return "k-d forest";
+    case Engine::Hnsw: return "HNSW";
+    case Engine::Ivf: return "IVF";
+    case Engine::Pq: return "PQ";
+    case Engine::Sq8: return "SQ8";
+    case Engine::Binary: return "Binary prefilter";
+    case Engine::Scan: return "Exact scan";
+    case Engine::Gemm: return "Blocked brute force";
+    default: return "KD-tree";
+    }
+}
+
+// The exact k-d tree engines and the scan, which runMain compiles for every embedding type
+bool isTreeOrScan(Engine engine)
+{
+    return engine == Engine::KDTree || engine == Engine::Forest || engine == Engine::Scan;
+}
+
+// Whether runMain compiles the other engines for T. The approximate engines and
+// the blocked brute force only pay off in many dimensions, so the low fixed
+// sizes leave them out and main runs them on std::vector<float> rows instead.
+template <typename T>
+constexpr bool kAllEngines = true;
+template <>
+constexpr bool kAllEngines<float> = false;
+template <size_t N>
+constexpr bool kAllEngines<std::array<float, N>> = (N > 4);
+
+// Optional flags following the positional arguments
+struct Options
+{
+    Engine engine = Engine::KDTree;  // --engine kdtree|forest|hnsw|ivf|pq|sq8|binary|scan|gemm
+    size_t trees = 4;            // --trees N: trees of the forest engine
+    HnswOptions hnsw;            // --M N, --ef-construction N, --ef-search N
+    IvfOptions ivf;              // --nlist N, --nprobe N
+    PqOptions pq;                // --pq-m N
+    Sq8Options sq8;              // --sq-clip F
+    GemmOptions gemm;            // --query-block N, --row-block N
+    Storage storage = Storage::F32;  // --storage f32|f16|bf16: rows rounded once the index is built
+    Metric metric = Metric::L2;  // --metric l2|l1|linf|ip|cosine: l1 and linf imply the exact scan
+    unsigned buildThreads = 1;   // --build-threads N
+    size_t leafSize = 1;         // --leaf-size N
+    bool batch = false;          // --batch: answer every query in the file
+    bool recall = false;         // --recall: batch mode also scores the results against the gemm engine
+    size_t maxQueries = 0;       // --max-queries N: at most N queries in batch mode, 0 = all
+    unsigned threads = 1;        // --threads N: search threads in batch mode
+    SearchOptions search;        // optional 5th positional argument <eps>, --max-checks N (best-bin-first)
+};
+
+// Parses "--name value" pairs (and the valueless --batch, --recall) from argv[first...];
+// returns false on an unknown flag.
+bool parseOptions(int argc, char **argv, int first, Options &opts)
+{
+    for (int i = first; i < argc; i += 2) {
+        std::string flag = argv[i];
+        if (flag == "--batch") {
+            opts.batch = true;
+            --i;
+            continue;
+        }
+        if (flag == "--recall") {
+            opts.recall = true;
+            opts.batch = true;
+            --i;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << flag << "\n";
+            return false;
+        }
+        std::string value = argv[i + 1];
+        if (flag == "--engine") {
+            if (value == "kdtree") {
+                opts.engine = Engine::KDTree;
+            } else if (value == "forest") {
+                opts.engine = Engine::Forest;
+            } else if (value == "hnsw") {
+                opts.engine = Engine::Hnsw;
+            } else if (value == "ivf") {
+                opts.engine = Engine::Ivf;
+            } else if (value == "pq") {
+                opts.engine = Engine::Pq;
+            } else if (value == "sq8") {
+                opts.engine = Engine::Sq8;
+            } else if (value == "binary") {
+                opts.engine = Engine::Binary;
+            } else if (value == "scan") {
+                opts.engine = Engine::Scan;
+            } else if (value == "gemm") {
+                opts.engine = Engine::Gemm;
+            } else {
+                std::cerr << "Unknown engine: " << value << "\n";
+                return false;
+            }
+        } else if (flag == "--trees") {
+            opts.trees = std::max(1, std::stoi(value));
+        } else if (flag == "--M") {
+            opts.hnsw.M = std::max(2, std::stoi(value));
+        } else if (flag == "--ef-construction") {
+            opts.hnsw.efConstruction = std::max(1, std::stoi(value));
+        } else if (flag == "--ef-search") {
+            opts.hnsw.efSearch = std::max(1, std::stoi(value));
+        } else if (flag == "--nlist") {
+            opts.ivf.nlist = std::max(1, std::stoi(value));
+        } else if (flag == "--nprobe") {
+            opts.ivf.nprobe = std::max(1, std::stoi(value));
+        } else if (flag == "--pq-m") {
+            opts.pq.m = std::max(1, std::stoi(value));
+        } else if (flag == "--storage") {
+            if (value == "f32") {
+                opts.storage = Storage::F32;
+            } else if (value == "f16") {
+                opts.storage = Storage::F16;
+            } else if (value == "bf16") {
+                opts.storage = Storage::BF16;
+            } else {
+                std::cerr << "Unknown storage: " << value << "\n";
+                return false;
+            }
+        } else if (flag == "--metric") {
+            if (!parseMetric(value, opts.metric)) {
+                std::cerr << "Unknown metric: " << value << "\n";
+                return false;
+            }
+        } else if (flag == "--query-block") {
+            opts.gemm.queryBlock = std::max(1, std::stoi(value));
+        } else if (flag == "--row-block") {
+            opts.gemm.rowBlock = std::max(1, std::stoi(value));
+        } else if (flag == "--sq-clip") {
+            opts.sq8.clip = std::stof(value);
+        } else if (flag == "--rerank") {
+            opts.search.rerank = std::max(0, std::stoi(value));
+        } else if (flag == "--build-threads") {
+            opts.buildThreads = std::max(1, std::stoi(value));
+        } else if (flag == "--leaf-size") {
+            opts.leafSize = std::max(1, std::stoi(value));
+        } else if (flag == "--threads") {
+            opts.threads = std::max(1, std::stoi(value));
+        } else if (flag == "--max-checks") {
+            opts.search.maxChecks = std::max(0, std::stoi(value));
+        } else if (flag == "--max-queries") {
+            opts.maxQueries = std::max(0, std::stoi(value));
+            opts.batch = true;
+        } else {
+            std::cerr << "Unknown option: " << flag << "\n";
+            return false;
+        }
+    }
+    // cosine and inner product map onto every engine (see MetricTransform), l1 and linf only onto the scan
+    if (opts.metric == Metric::L1 || opts.metric == Metric::Linf) {
+        if (opts.engine != Engine::KDTree && opts.engine != Engine::Scan) {
+            std::cerr << "--metric l1|linf cannot be combined with --engine other than scan\n";
+            return false;
+        }
+        opts.engine = Engine::Scan;
+    }
+    // the scan reads half-precision rows only under l2 (see MetricScan)
+    if (opts.storage != Storage::F32 && opts.engine == Engine::Scan && opts.metric != Metric::L2) {
+        std::cerr << "--storage f16|bf16 with --engine scan only supports --metric l2\n";
+        return false;
+    }
+    // the ground truth is squared L2 over the rows the engine searches
+    if (opts.recall && opts.engine == Engine::Scan && opts.metric != Metric::L2) {
+        std::cerr << "--recall with --engine scan needs --metric l2\n";
+        return false;
+    }
+    return true;
+}
+
+// Dimensions the index works in: the input plus those MetricTransform adds
+size_t indexDim(size_t dim, const Options &opts)
+{
+    return dim + (opts.engine == Engine::Scan ? 0 : MetricTransform::extraDims(opts.metric));
+}
+
+/**
+ * @brief Answers every query of the file (up to opts.maxQueries) against one index.
+ *
+ * The searches run on opts.threads workers; afterwards the neighbors of each
+ * query are printed in file order.
+ *
+ * @param query_json The parsed query file.
+ * @param answer Callable (const float *queries, size_t nq, WorkStealingPool &pool,
+ *               BatchResults &out) searching the index for a batch.
+ * @param truth The same for the exact results --recall compares with.
+ * @param transform Prepares the queries, read with transform.dim floats.
+ * @param opts Command line options.
+ * @param search_ms Receives the wall time of the searches, in milliseconds.
+ * @param recall Receives recall@K against truth with --recall.
+ * @return The per-query search latencies in microseconds.
+ */
+template <typename T, typename Answer, typename Truth>
+std::vector<double> runBatch(const json &query_json, Answer answer, Truth truth,
+                             const MetricTransform &transform, const Options &opts,
+                             double &search_ms, double &recall)
+{
+    size_t dim = Embedding_T<T>::Dim();
+    size_t nq = query_json.size();
+    if (opts.maxQueries > 0) {
+        nq = std::min(nq, opts.maxQueries);
+    }
+
+    // Parse all queries up front so only the searches are timed
+    std::vector<float> qrows(nq * dim);
+    for (size_t q = 0; q < nq; ++q) {
+        readEmbedding(query_json[q]["embedding"], &qrows[q * dim], transform.dim);
+        transform.prepareQuery(&qrows[q * dim]);
+    }
+
+    WorkStealingPool pool(opts.threads);
+    BatchResults results;
+    auto search_start = std::chrono::high_resolution_clock::now();
+    answer(qrows.data(), nq, pool, results);
+    std::chrono::duration<double, std::milli> search_duration =
+        std::chrono::high_resolution_clock::now() - search_start;
+    search_ms = search_duration.count();
+
+    if (opts.recall) {
+        BatchResults exact;
+        truth(qrows.data(), nq, pool, exact);
+        recall = recallAtK(results, exact);
+    }
+
+    for (size_t q = 0; q < nq; ++q) {
+        std::cout << "query " << q << ":\n";
+        std::cout << "  text:    " << query_json[q]["text"] << "\n";
+        const PQItem *nb = results.neighbors(q);
+        for (int32_t i = 0; i < results.count[q]; ++i) {
+            std::cout << "  " << (i + 1) << ". id: " << nb[i].second
+                      << ", dist = " << nb[i].first << "\n";
+        }
+        std::cout << "\n";
+    }
+    return results.latencyUs;
+}
+
 template <typename T>
-int runMain(char **argv)
+int runMain(char **argv, const Options &opts)
 {
     auto program_start = std::chrono::high_resolution_clock::now();
 
@@ -47,61 +310,197 @@ int runMain(char **argv)
     int K = std::stoi(argv[2]);
 
 
+    // The engines other than the scan see cosine and inner product as L2 on transformed rows
+    MetricTransform transform;
+    transform.metric = opts.engine == Engine::Scan ? Metric::L2 : opts.metric;
+    transform.dim = Embedding_T<T>::Dim() - MetricTransform::extraDims(transform.metric);
+
     // Extract the query embedding from query_json[0]
     auto query_obj = query_json[0];
-    T qemb;
-    if constexpr (std::is_same_v<T, float>) {
-        qemb = query_obj["embedding"].get<float>();
-    } else {
-        qemb.resize(Embedding_T<T>::Dim());
-        for (size_t i = 0; i < Embedding_T<T>::Dim(); ++i) {
-            qemb[i] = query_obj["embedding"][i].get<float>();
-        }
-    }
-    Node<T>::queryEmbedding = qemb;
-
-    // Collect all passages into allPoints
-    std::vector<std::pair<T, int>> allPoints;
-    allPoints.reserve(passages_json.size());
+    std::vector<float> qrow(Embedding_T<T>::Dim());
+    readEmbedding(query_obj["embedding"], qrow.data(), transform.dim);
+    transform.prepareQuery(qrow.data());
+    T qemb = fromRow<T>(qrow.data());
+
+    // Collect all passage embeddings into one contiguous store
+    EmbeddingStore store(Embedding_T<T>::Dim());
+    store.reserve(passages_json.size());
     for (const auto& elem : passages_json) {
-        T emb;
-        if constexpr (std::is_same_v<T, float>) {
-            emb = elem["embedding"].get<float>();
-        } else {
-            emb.resize(Embedding_T<T>::Dim());
-            for (size_t i = 0; i < Embedding_T<T>::Dim(); ++i) {
-                emb[i] = elem["embedding"][i].get<float>();
-            }
-        }
-        int idx = elem["id"].get<int>();
-        allPoints.emplace_back(emb, idx);
+        readEmbedding(elem["embedding"], store.append(elem["id"].get<int>()), transform.dim);
+    }
+    // only cosine and inner product read the norms
+    if (opts.metric == Metric::Cosine || opts.metric == Metric::InnerProduct) {
+        store.computeNorms();
     }
+    transform.prepareStore(store);
 
     auto processing_end = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double, std::milli> processing_duration = processing_end - program_start;
 
 
-    // Build balanced KD‐tree
+    // Build the selected index: a balanced KD‐tree, a randomized forest, an HNSW graph, inverted lists or quantized codes
     auto buildtree_start = std::chrono::high_resolution_clock::now();
-    Node<T>* root = buildKD(allPoints, 0);
+    KDTree<T> tree;
+    KDForest<T> forest;
+    HnswGraph<T> graph;
+    IvfIndex<T> ivf;
+    PqIndex<T> pq;
+    Sq8Index<T> sq8;
+    BinaryIndex<T> binary;
+    MetricScan<T> scan;
+    GemmIndex<T> gemm;
+    if (opts.engine == Engine::Scan) {
+        scan = buildMetricScan<T>(store, opts.metric);
+    }
+    else if (opts.engine == Engine::Forest) {
+        ForestOptions build;
+        build.trees = opts.trees;
+        build.leafSize = opts.leafSize;
+        build.threads = opts.buildThreads;
+        forest = buildKDForest<T>(store, build);
+    }
+    else if (opts.engine == Engine::KDTree) {
+        BuildOptions build;
+        build.threads = opts.buildThreads;
+        build.leafSize = opts.leafSize;
+        tree = buildKDTree<T>(store, build);
+    }
+    else if constexpr (kAllEngines<T>) {
+        if (opts.engine == Engine::Gemm) {
+            gemm = buildGemm<T>(store, opts.gemm);
+        }
+        else if (opts.engine == Engine::Binary) {
+            binary = buildBinary<T>(store, opts.buildThreads);
+        }
+        else if (opts.engine == Engine::Sq8) {
+            Sq8Options build = opts.sq8;
+            build.threads = opts.buildThreads;
+            sq8 = buildSq8<T>(store, build);
+        }
+        else if (opts.engine == Engine::Pq) {
+            PqOptions build = opts.pq;
+            build.threads = opts.buildThreads;
+            pq = buildPq<T>(store, build);
+        }
+        else if (opts.engine == Engine::Ivf) {
+            IvfOptions build = opts.ivf;
+            build.threads = opts.buildThreads;
+            ivf = buildIvf<T>(store, build);
+        }
+        else {
+            HnswOptions build = opts.hnsw;
+            build.threads = opts.buildThreads;
+            graph = buildHnsw<T>(store, build);
+        }
+    }
+    // the indexes are built from fp32 rows; from here on the rows may be half precision
+    store.toHalf(opts.storage);
     auto buildtree_end = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double, std::milli> buildtree_duration = buildtree_end - buildtree_start;
 
+    // Answers one query with the selected index
+    auto search = [&](const float *query, SearchContext &ctx) {
+        if (opts.engine == Engine::Scan) {
+            knnSearch(scan, query, K, ctx);
+        }
+        else if (opts.engine == Engine::Forest) {
+            knnSearch(forest, query, K, ctx, opts.search);
+        }
+        else if (opts.engine == Engine::KDTree) {
+            if (opts.search.maxChecks > 0) {
+                knnSearchBestBin(tree, query, K, ctx, opts.search);
+            }
+            else {
+                knnSearch(tree, query, K, ctx, opts.search);
+            }
+        }
+        else if constexpr (kAllEngines<T>) {
+            if (opts.engine == Engine::Gemm) {
+                knnSearch(gemm, query, K, ctx);
+            }
+            else if (opts.engine == Engine::Binary) {
+                knnSearch(binary, query, K, ctx, opts.search);
+            }
+            else if (opts.engine == Engine::Sq8) {
+                knnSearch(sq8, query, K, ctx, opts.search);
+            }
+            else if (opts.engine == Engine::Pq) {
+                knnSearch(pq, query, K, ctx, opts.search);
+            }
+            else if (opts.engine == Engine::Ivf) {
+                knnSearch(ivf, query, K, ctx);
+            }
+            else {
+                knnSearch(graph, query, K, ctx);
+            }
+        }
+    };
+
+    // The scan ranks by MetricPolicy values, the other engines by squared L2 on transformed rows
+    auto report = [&](const float *query, float key) {
+        return opts.engine == Engine::Scan ? metricDistance(opts.metric, key) : transform.distance(query, key);
+    };
+
+    if (opts.batch) {
+        // the gemm engine answers whole blocks of queries, the others one query at a time
+        auto answer = [&](const float *queries, size_t nq, WorkStealingPool &pool, BatchResults &out) {
+            if constexpr (kAllEngines<T>) {
+                if (opts.engine == Engine::Gemm) {
+                    searchBatchGemm(gemm, queries, nq, K, pool, out, report);
+                    return;
+                }
+            }
+            searchBatch(queries, nq, Embedding_T<T>::Dim(), K, pool, out, search, report);
+        };
+        // the ground truth comes from the blocked brute force, or in few dimensions from the L2 scan
+        auto truth = [&](const float *queries, size_t nq, WorkStealingPool &pool, BatchResults &out) {
+            if constexpr (kAllEngines<T>) {
+                if (gemm.size() != store.size()) {
+                    gemm = buildGemm<T>(store, opts.gemm);
+                }
+                searchBatchGemm(gemm, queries, nq, K, pool, out, report);
+            }
+            else {
+                MetricScan<T> exact = buildMetricScan<T>(store, Metric::L2);
+                searchBatch(queries, nq, Embedding_T<T>::Dim(), K, pool, out,
+                            [&](const float *query, SearchContext &ctx) { knnSearch(exact, query, K, ctx); }, report);
+            }
+        };
+
+        auto batch_start = std::chrono::high_resolution_clock::now();
+        double search_ms = 0, recall = 0;
+        std::vector<double> latencies = runBatch<T>(query_json, answer, truth, transform, opts, search_ms, recall);
+        std::chrono::duration<double, std::milli> batch_duration =
+            std::chrono::high_resolution_clock::now() - batch_start;
+        std::chrono::duration<double, std::milli> program_duration =
+            std::chrono::high_resolution_clock::now() - program_start;
+
+        std::cout << "#### Performance Metrics ####\n";
+        std::cout << "Elapsed time: " << program_duration.count() << " ms\n";
+        std::cout << "Processing time: " << processing_duration.count() << " ms\n";
+        std::cout << engineName(opts.engine) << " build time: " << buildtree_duration.count() << " ms\n";
+        std::cout << "Queries: " << latencies.size() << " on " << opts.threads << " threads\n";
+        std::cout << "Batch time: " << batch_duration.count() << " ms (search " << search_ms << " ms)\n";
+        std::cout << "Throughput: " << latencies.size() / (search_ms / 1000.0) << " QPS\n";
+        printLatencySummary(latencies);
+        if (opts.recall) {
+            std::cout << "Recall@" << K << ": " << recall << "\n";
+        }
+        return 0;
+    }
+
     // Perform K‐NN search and collect results
     auto query_start = std::chrono::high_resolution_clock::now();
-    MaxHeap heap;
-    knnSearch(root, 0, K, heap);
+    SearchContext ctx;
+    search(coords(qemb), ctx);
     auto query_end = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double, std::milli> query_duration = query_end - query_start;
 
-    // Collect and sort ascending by distance
+    // Results come sorted by (squared distance, id); report the metric's distances
     std::vector<PQItem> out;
-    while (!heap.empty()) {
-        out.push_back(heap.top());
-        heap.pop();
+    for (const PQItem &item : ctx.results) {
+        out.push_back({report(qrow.data(), item.first), item.second});
     }
-    std::sort(out.begin(), out.end(),
-              [](auto &a, auto &b) { return a.first < b.first; });
 
     auto program_end = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double, std::milli> program_duration = program_end - program_start;
@@ -145,10 +544,9 @@ int runMain(char **argv)
     std::cout << "#### Performance Metrics ####\n";
     std::cout << "Elapsed time: " << program_duration.count() << " ms\n";
     std::cout << "Processing time: " << processing_duration.count() << " ms\n";
-    std::cout << "KD-tree build time: " << buildtree_duration.count() << " ms\n";
+    std::cout << engineName(opts.engine) << " build time: " << buildtree_duration.count() << " ms\n";
     std::cout << "K-NN query time: " << query_duration.count() << " ms\n";
 
-    freeTree(root);
     return 0;
 }
 
@@ -156,13 +554,24 @@ int runMain(char **argv)
 
 int main(int argc, char **argv)
 {
-    if (argc != 5) {
-        std::cerr << "Usage: " << argv[0] << " <dim> <query.json> <data.json> <K>\n";
+    Options opts;
+    // like part3, an optional <eps> may follow K (0 = exact search)
+    int first = 5;
+    if (argc > 5 && std::string(argv[5]).rfind("--", 0) != 0) {
+        opts.search.eps = std::max(0.0f, std::stof(argv[5]));
+        first = 6;
+    }
+    if (argc < 5 || !parseOptions(argc, argv, first, opts)) {
+        std::cerr << "Usage: " << argv[0] << " <dim> <query.json> <data.json> <K> [eps]"
+                  << " [--build-threads N] [--leaf-size N] [--batch] [--max-queries N] [--threads N]"
+                  << " [--max-checks N] [--engine kdtree|forest|hnsw|ivf|pq|sq8|binary|scan|gemm] [--trees N]"
+                  << " [--M N] [--ef-construction N] [--ef-search N] [--nlist N] [--nprobe N]"
+                  << " [--pq-m N] [--sq-clip F] [--rerank N] [--storage f32|f16|bf16]"
+                  << " [--metric l2|l1|linf|ip|cosine] [--query-block N] [--row-block N] [--recall]\n";
         return 1;
     }
 
-    // mode 0: scalar float, mode 1: fixed-size array<float,20>
-    size_t dim = std::stoi(argv[1]);
+    size_t dim = indexDim(std::stoi(argv[1]), opts);
     assert (dim >= 1);
     runtime_dim() = dim;
 
@@ -173,9 +582,15 @@ int main(int argc, char **argv)
 
 
 
-    if (dim == 1) {
-        return runMain<float>(new_argv);
-    } else {
-         return runMain<std::vector<float>>(new_argv);
-    }
+    // scalar float for 1-D, std::array<float, dim> for common dims, std::vector<float> otherwise;
+    // the engines compiled only for many dimensions take std::vector<float> for the low ones
+    return withEmbeddingType(dim, [&](auto type) {
+        using T = typename decltype(type)::type;
+        if constexpr (!kAllEngines<T>) {
+            if (!isTreeOrScan(opts.engine)) {
+                return runMain<std::vector<float>>(new_argv, opts);
+            }
+        }
+        return runMain<T>(new_argv, opts);
+    });
 }
\ No newline at end of file
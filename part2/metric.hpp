@@ -0,0 +1,251 @@
+#pragma once
+
+#include "knn.hpp"
+
+// Distance the neighbors are ranked by; smaller is always closer
+enum class Metric
+{
+    L2,             // Euclidean
+    L1,             // Manhattan
+    Linf,           // Chebyshev: largest coordinate difference
+    InnerProduct,   // -q·x, i.e. maximum inner product search
+    Cosine,         // 1 - cos(q, x)
+};
+
+inline const char *metricName(Metric metric)
+{
+    switch (metric) {
+    case Metric::L1: return "l1";
+    case Metric::Linf: return "linf";
+    case Metric::InnerProduct: return "ip";
+    case Metric::Cosine: return "cosine";
+    default: return "l2";
+    }
+}
+
+// Parses one of the names above; returns false if name is not one.
+inline bool parseMetric(const std::string &name, Metric &metric)
+{
+    for (Metric m : {Metric::L2, Metric::L1, Metric::Linf, Metric::InnerProduct, Metric::Cosine}) {
+        if (name == metricName(m)) {
+            metric = m;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Distance of metric M between two embeddings of type T.
+ *
+ * L2 goes through Embedding_T<T>::distance_sq and, like everywhere else,
+ * ranks by the squared distance (see metricDistance); the others use the
+ * active kernel set. The norms of both sides are passed in, precomputed, and
+ * only read by Cosine. With Normalized = true both sides are taken to have
+ * unit norm, which saves the division.
+ */
+template <typename T, Metric M, bool Normalized = false>
+struct MetricPolicy
+{
+    static constexpr bool kNeedsNorms = M == Metric::Cosine && !Normalized;
+
+    static float distance(const float *a, const float *b, float normA, float normB)
+    {
+        if constexpr (M == Metric::L2) {
+            return Embedding_T<T>::distance_sq(a, b);
+        }
+        else if constexpr (M == Metric::L1) {
+            return distanceKernels().l1(a, b, Embedding_T<T>::Dim());
+        }
+        else if constexpr (M == Metric::Linf) {
+            return distanceKernels().linf(a, b, Embedding_T<T>::Dim());
+        }
+        else if constexpr (M == Metric::InnerProduct) {
+            return -distanceKernels().dot(a, b, Embedding_T<T>::Dim());
+        }
+        else if constexpr (Normalized) {
+            return 1.0f - distanceKernels().dot(a, b, Embedding_T<T>::Dim());
+        }
+        else {
+            float norms = normA * normB;
+            return norms > 0.0f ? 1.0f - distanceKernels().dot(a, b, Embedding_T<T>::Dim()) / norms : 1.0f;
+        }
+    }
+};
+
+// The metric's distance for a MetricPolicy value: the square root for L2, the value itself otherwise.
+inline float metricDistance(Metric metric, float key)
+{
+    return metric == Metric::L2 ? std::sqrt(key) : key;
+}
+
+/**
+ * @brief Maps cosine and inner-product search onto the squared-L2 engines.
+ *
+ * Cosine: rows and queries are scaled to unit norm, so |q - x|² = 2 - 2·cos
+ * and the L2 order is the cosine order. Rows that were loaded normalized are
+ * left as they are.
+ *
+ * Inner product: every row gets one extra coordinate sqrt(M² - |x|²), M the
+ * largest row norm, and queries get a 0 there. All rows then have norm M and
+ * |q - x|² = |q|² + M² - 2·q·x, so the nearest row is the one with the
+ * largest inner product and the k-d tree, whose pruning needs a true metric,
+ * answers maximum inner product search exactly.
+ *
+ * L2 is the identity. L1 and L∞ cannot be mapped; they go through MetricScan.
+ */
+struct MetricTransform
+{
+    Metric metric = Metric::L2;
+    size_t dim = 0;             // input dimensions; rows and queries have dim + extraDims()
+    float maxNormSq = 0.0f;     // inner product: M²
+
+    static size_t extraDims(Metric metric) { return metric == Metric::InnerProduct ? 1 : 0; }
+
+    /**
+     * Transforms the rows of a store in place.
+     *
+     * @param store Rows of dim + extraDims() floats with the extra ones zero;
+     *              its norms must be computed.
+     */
+    void prepareStore(EmbeddingStore &store)
+    {
+        if (metric == Metric::Cosine && !store.normalized()) {
+            for (size_t r = 0; r < store.size(); ++r) {
+                float n = store.norm(r);
+                if (n > 0.0f) {
+                    for (size_t d = 0; d < dim; ++d) store.row(r)[d] /= n;
+                }
+            }
+        }
+        else if (metric == Metric::InnerProduct) {
+            maxNormSq = 0.0f;
+            for (size_t r = 0; r < store.size(); ++r) {
+                maxNormSq = std::max(maxNormSq, store.norm(r) * store.norm(r));
+            }
+            for (size_t r = 0; r < store.size(); ++r) {
+                store.row(r)[dim] = std::sqrt(std::max(0.0f, maxNormSq - store.norm(r) * store.norm(r)));
+            }
+        }
+    }
+
+    // Transforms a query in place, dim + extraDims() floats with the extra ones zero.
+    void prepareQuery(float *query) const
+    {
+        if (metric == Metric::Cosine) {
+            float n = std::sqrt(distanceKernels().dot(query, query, dim));
+            if (n > 0.0f) {
+                for (size_t d = 0; d < dim; ++d) query[d] /= n;
+            }
+        }
+    }
+
+    // Converts an engine's squared L2 distance to a prepared query into the metric's distance.
+    float distance(const float *query, float l2sq) const
+    {
+        switch (metric) {
+        case Metric::Cosine: return 0.5f * l2sq;
+        case Metric::InnerProduct:
+            return 0.5f * (l2sq - distanceKernels().dot(query, query, dim) - maxNormSq);
+        default: return std::sqrt(l2sq);
+        }
+    }
+};
+
+/**
+ * Exact scan of a store under any metric. Cosine uses the norms cached in the
+ * store, which must then be computed; the store must outlive the scan. Only
+ * L2 scans a half-precision store, the other metrics read fp32 rows.
+ */
+template <typename T>
+struct MetricScan
+{
+    const EmbeddingStore *store = nullptr;
+    Metric metric = Metric::L2;
+    bool normalized = false;    // every row has unit norm
+};
+
+template <typename T>
+MetricScan<T> buildMetricScan(const EmbeddingStore &store, Metric metric)
+{
+    return {&store, metric, store.normalized()};
+}
+
+// Scans every row; distance(r) gives the query's distance to store row r.
+template <typename Distance>
+void metricScan(const EmbeddingStore &store, int K, SearchContext &ctx, Distance distance)
+{
+    auto scan = [&](auto &top) {
+        top.reset(K);
+        for (size_t r = 0; r < store.size(); ++r) {
+            float d = distance(r);
+            if (d <= top.worst()) {
+                top.offer(d, store.id(r));
+            }
+        }
+        ctx.checks += store.size();
+        ctx.results = top.sorted();
+    };
+    if (K <= kSmallK) {
+        scan(ctx.small);
+    }
+    else {
+        scan(ctx.heap);
+    }
+}
+
+// Scans every row with policy P.
+template <typename P>
+void metricScan(const EmbeddingStore &store, const float *query, float queryNorm, int K, SearchContext &ctx)
+{
+    metricScan(store, K, ctx, [&](size_t r) {
+        return P::distance(query, store.row(r), queryNorm, P::kNeedsNorms ? store.norm(r) : 0.0f);
+    });
+}
+
+/**
+ * @brief Exact k-NN scan under the scan's metric.
+ *
+ * ctx.results holds MetricPolicy values: squared distances for L2, the
+ * metric's distances otherwise (see metricDistance). Cosine against a store
+ * loaded normalized skips the division by the norms when the query has unit
+ * norm too.
+ *
+ * @param scan The store and metric.
+ * @param query The query, Dim() contiguous floats.
+ * @param K Number of nearest neighbors to search for.
+ * @param ctx Caller-owned context; ctx.results receives the neighbors, valid until its next search.
+ */
+template <typename T>
+void knnSearch(const MetricScan<T> &scan, const float *query, int K, SearchContext &ctx)
+{
+    ctx.start(Embedding_T<T>::Dim());
+    const EmbeddingStore &store = *scan.store;
+    switch (scan.metric) {
+    case Metric::L1:
+        metricScan<MetricPolicy<T, Metric::L1>>(store, query, 0.0f, K, ctx);
+        break;
+    case Metric::Linf:
+        metricScan<MetricPolicy<T, Metric::Linf>>(store, query, 0.0f, K, ctx);
+        break;
+    case Metric::InnerProduct:
+        metricScan<MetricPolicy<T, Metric::InnerProduct>>(store, query, 0.0f, K, ctx);
+        break;
+    case Metric::Cosine: {
+        float queryNorm = std::sqrt(distanceKernels().dot(query, query, Embedding_T<T>::Dim()));
+        if (scan.normalized && std::abs(queryNorm - 1.0f) <= 1e-3f) {
+            metricScan<MetricPolicy<T, Metric::Cosine, true>>(store, query, queryNorm, K, ctx);
+        }
+        else {
+            metricScan<MetricPolicy<T, Metric::Cosine>>(store, query, queryNorm, K, ctx);
+        }
+        break;
+    }
+    default:
+        // MetricPolicy<T, Metric::L2> with the kernel picked once for the whole scan
+        withDistanceSq<T>(store, [&](auto dist) {
+            metricScan(store, K, ctx, [&](size_t r) { return dist(query, r); });
+        });
+        break;
+    }
+}
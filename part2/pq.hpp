@@ -0,0 +1,211 @@
+#pragma once
+
+#include "knn.hpp"
+#include "kmeans.hpp"
+
+// Centroids per subspace, so that a code is one byte
+constexpr size_t kPqCentroids = 256;
+
+/**
+ * Options of a product quantizer.
+ *
+ * Vectors are cut into m subspaces of consecutive dimensions (sizes differ by
+ * at most one when m does not divide the dimension), and each subspace gets
+ * up to 256 centroids trained with ALGLIB k-means on sampleSize rows
+ * (0 = 32 rows per centroid). A subspace whose sample has fewer distinct
+ * subvectors than that gets those subvectors as its centroids. Training and
+ * encoding use `threads` threads.
+ */
+struct PqOptions
+{
+    size_t m = 8;
+    size_t sampleSize = 0;
+    int restarts = 1;
+    int maxIterations = 20;
+    uint64_t seed = 1;
+    unsigned threads = 1;
+};
+
+/**
+ * Product-quantized copy of an embedding store: m bytes per row, each the
+ * index of the nearest centroid of one subspace. The store is kept (and must
+ * outlive the index) only to re-rank candidates with exact distances.
+ */
+template <typename T>
+struct PqIndex
+{
+    const EmbeddingStore *store = nullptr;
+    size_t m = 0;
+    size_t ksub = 0;                    // centroids per subspace, <= kPqCentroids
+    std::vector<size_t> subStart;       // subspace s is dimensions [subStart[s], subStart[s + 1])
+    std::vector<float> codebook;        // subspace s: ksub centroids of its width, from offset ksub * subStart[s]
+    std::vector<uint8_t> codes;         // row r: codes[r * m .. r * m + m)
+
+    size_t size() const { return store ? store->size() : 0; }
+
+    const float *centroid(size_t s, size_t c) const
+    {
+        return &codebook[ksub * subStart[s] + c * (subStart[s + 1] - subStart[s])];
+    }
+};
+
+/**
+ * Trains a product quantizer on a sample of a store and encodes every row.
+ *
+ * @param store The embeddings; not modified, must outlive the index.
+ * @param options Number of subspaces, training sample and threads.
+ * @return The index.
+ */
+template <typename T>
+PqIndex<T> buildPq(const EmbeddingStore &store, const PqOptions &options = {})
+{
+    PqIndex<T> index;
+    index.store = &store;
+    size_t n = store.size();
+    size_t dim = store.dim();
+    index.m = std::clamp<size_t>(options.m, 1, dim);
+    size_t m = index.m;
+    for (size_t s = 0; s <= m; ++s) {
+        index.subStart.push_back(s * dim / m);
+    }
+    if (n == 0) return index;
+
+    size_t samples = options.sampleSize > 0 ? options.sampleSize : 32 * kPqCentroids;
+    std::vector<int32_t> rows = sampleRows(n, samples, options.seed);
+    index.ksub = std::min(kPqCentroids, rows.size());
+    index.codebook.resize(index.ksub * dim);
+
+    // one k-means per subspace; subspaces are independent
+    unsigned threads = std::clamp<unsigned>(options.threads, 1, static_cast<unsigned>(m));
+    parallelFor(threads, [&](unsigned t) {
+        std::vector<float> trained;
+        for (size_t s = t; s < m; s += threads) {
+            size_t first = index.subStart[s], width = index.subStart[s + 1] - first;
+            alglib::real_2d_array xy;
+            xy.setlength(rows.size(), width);
+            for (size_t i = 0; i < rows.size(); ++i) {
+                const float *p = store.row(rows[i]) + first;
+                for (size_t d = 0; d < width; ++d) xy[i][d] = p[d];
+            }
+            kmeans(xy, index.ksub, {options.restarts, options.maxIterations, options.seed + s}, trained);
+            // with fewer distinct subvectors than ksub, the last centroid fills the
+            // remaining slots; encoding keeps the first of equal centroids
+            float *codebook = &index.codebook[index.ksub * first];
+            std::copy(trained.begin(), trained.end(), codebook);
+            for (size_t c = trained.size() / width; c < index.ksub; ++c) {
+                std::copy_n(codebook + (c - 1) * width, width, codebook + c * width);
+            }
+        }
+    });
+
+    // nearest centroid of every subvector
+    index.codes.resize(n * m);
+    threads = std::max(1u, options.threads);
+    parallelFor(threads, [&](unsigned t) {
+        for (size_t r = n * t / threads; r < n * (t + 1) / threads; ++r) {
+            const float *p = store.row(r);
+            for (size_t s = 0; s < m; ++s) {
+                size_t first = index.subStart[s], width = index.subStart[s + 1] - first;
+                float best = std::numeric_limits<float>::infinity();
+                for (size_t c = 0; c < index.ksub; ++c) {
+                    const float *q = index.centroid(s, c);
+                    float d = 0.0f;
+                    for (size_t i = 0; i < width; ++i) {
+                        float diff = p[first + i] - q[i];
+                        d += diff * diff;
+                    }
+                    if (d < best) {
+                        best = d;
+                        index.codes[r * m + s] = static_cast<uint8_t>(c);
+                    }
+                }
+            }
+        }
+    });
+    return index;
+}
+
+// Fills ctx.table with the squared distance of every subquery to every
+// centroid of its subspace: entry s * kPqCentroids + c.
+template <typename T>
+void pqDistanceTable(const PqIndex<T> &index, const float *query, SearchContext &ctx)
+{
+    ctx.table.assign(index.m * kPqCentroids, 0.0f);
+    for (size_t s = 0; s < index.m; ++s) {
+        size_t first = index.subStart[s], width = index.subStart[s + 1] - first;
+        float *row = &ctx.table[s * kPqCentroids];
+        for (size_t c = 0; c < index.ksub; ++c) {
+            const float *q = index.centroid(s, c);
+            float d = 0.0f;
+            for (size_t i = 0; i < width; ++i) {
+                float diff = query[first + i] - q[i];
+                d += diff * diff;
+            }
+            row[c] = d;
+        }
+    }
+}
+
+/**
+ * @brief k-NN search on a product-quantized index with asymmetric distances.
+ *
+ * The query stays exact: one lookup table of subquery-to-centroid distances
+ * is built per query, and the distance to a code is the sum of m table
+ * entries. With options.rerank > K, that many closest codes are re-ranked
+ * with exact distances to the stored vectors; otherwise the K closest codes
+ * are reported with their approximate distances.
+ *
+ * @param index The product-quantized index.
+ * @param query The query, Dim() contiguous floats.
+ * @param K Number of nearest neighbors to search for.
+ * @param ctx Caller-owned context; ctx.results receives the neighbors, valid until its next search.
+ * @param options Number of candidates to re-rank.
+ */
+template <typename T>
+void knnSearch(const PqIndex<T> &index, const float *query, int K, SearchContext &ctx,
+               const SearchOptions &options = {})
+{
+    ctx.start(Embedding_T<T>::Dim());
+    pqDistanceTable(index, query, ctx);
+    const EmbeddingStore &store = *index.store;
+    const float *table = ctx.table.data();
+    size_t m = index.m;
+    size_t n = index.size();
+    bool rerank = options.rerank > static_cast<size_t>(K);
+
+    auto scan = [&](auto &top, auto label) {
+        const uint8_t *code = index.codes.data();
+        for (size_t r = 0; r < n; ++r, code += m) {
+            float d = 0.0f;
+            for (size_t s = 0; s < m; ++s) {
+                d += table[s * kPqCentroids + code[s]];
+            }
+            if (d <= top.worst()) {
+                top.offer(d, label(r));
+            }
+        }
+        ctx.checks += n;
+    };
+    auto search = [&](auto &top) {
+        top.reset(K);
+        if (rerank) {
+            ctx.beam.reset(static_cast<int>(options.rerank));
+            scan(ctx.beam, [](size_t r) { return static_cast<int>(r); });
+            withDistanceSq<T>(store, [&](auto dist) {
+                for (const PQItem &c : ctx.beam.sorted()) {
+                    top.offer(dist(query, c.second), store.id(c.second));
+                }
+            });
+        }
+        else {
+            scan(top, [&](size_t r) { return store.id(r); });
+        }
+        ctx.results = top.sorted();
+    };
+    if (K <= kSmallK) {
+        search(ctx.small);
+    }
+    else {
+        search(ctx.heap);
+    }
+}
@@ -0,0 +1,193 @@
+#pragma once
+
+#include "knn.hpp"
+
+// Code rows are padded with zeros to a multiple of this many bytes, so the
+// SIMD kernels never need their scalar tail
+constexpr size_t kSq8Pad = 32;
+
+/**
+ * Options of an int8 scalar quantizer.
+ *
+ * Each dimension is calibrated to the range [lo, hi] of its values: the
+ * minimum and maximum, or with clip > 0 the clip and 1 - clip quantiles, so
+ * a few outliers do not stretch the range; values outside are saturated.
+ * Calibration and encoding use `threads` threads.
+ */
+struct Sq8Options
+{
+    float clip = 0.0f;
+    unsigned threads = 1;
+};
+
+/**
+ * int8 copy of an embedding store: code = round((x - center[d]) / scale[d])
+ * in [-127, 127], with a per-dimension center and scale (the dimension's
+ * range over 254 steps), so narrow dimensions keep their full resolution.
+ * Queries are not quantized the same way: see knnSearch. The store is kept
+ * (and must outlive the index) to re-rank candidates with exact distances.
+ */
+template <typename T>
+struct Sq8Index
+{
+    const EmbeddingStore *store = nullptr;
+    size_t stride = 0;                  // bytes per code row
+    std::vector<float> center;
+    std::vector<float> scale;
+    std::vector<float> codeNormSq;      // |decoded row - center|² of every row
+    std::vector<int8_t, AlignedAllocator<int8_t>> codes;
+
+    size_t size() const { return store ? store->size() : 0; }
+    const int8_t *code(size_t r) const { return codes.data() + r * stride; }
+
+    // Writes the code of x into out[0, stride), padding included
+    void encode(const float *x, int8_t *out) const
+    {
+        size_t dim = center.size();
+        for (size_t d = 0; d < dim; ++d) {
+            float c = std::nearbyint((x[d] - center[d]) / scale[d]);
+            out[d] = static_cast<int8_t>(std::clamp(c, -127.0f, 127.0f));
+        }
+        std::fill(out + dim, out + stride, int8_t(0));
+    }
+};
+
+/**
+ * Calibrates an int8 scalar quantizer on a store and encodes every row.
+ *
+ * @param store The embeddings; not modified, must outlive the index.
+ * @param options Range calibration and threads.
+ * @return The index.
+ */
+template <typename T>
+Sq8Index<T> buildSq8(const EmbeddingStore &store, const Sq8Options &options = {})
+{
+    Sq8Index<T> index;
+    index.store = &store;
+    size_t n = store.size();
+    size_t dim = store.dim();
+    index.stride = (dim + kSq8Pad - 1) / kSq8Pad * kSq8Pad;
+    index.center.assign(dim, 0.0f);
+    index.scale.assign(dim, 1.0f);
+    if (n == 0) return index;
+
+    // per-dimension range
+    std::vector<float> lo(dim), hi(dim);
+    float clip = std::clamp(options.clip, 0.0f, 0.5f);
+    unsigned threads = std::clamp<unsigned>(options.threads, 1, static_cast<unsigned>(dim));
+    parallelFor(threads, [&](unsigned t) {
+        std::vector<float> column(n);
+        for (size_t d = t; d < dim; d += threads) {
+            for (size_t r = 0; r < n; ++r) column[r] = store.row(r)[d];
+            size_t low = static_cast<size_t>(clip * (n - 1));
+            size_t high = n - 1 - low;
+            std::nth_element(column.begin(), column.begin() + low, column.end());
+            lo[d] = column[low];
+            std::nth_element(column.begin() + low, column.begin() + high, column.end());
+            hi[d] = column[high];
+        }
+    });
+
+    for (size_t d = 0; d < dim; ++d) {
+        index.center[d] = 0.5f * (lo[d] + hi[d]);
+        if (hi[d] > lo[d]) index.scale[d] = (hi[d] - lo[d]) / 254.0f;
+    }
+
+    index.codes.resize(n * index.stride);
+    index.codeNormSq.resize(n);
+    threads = std::max(1u, options.threads);
+    parallelFor(threads, [&](unsigned t) {
+        for (size_t r = n * t / threads; r < n * (t + 1) / threads; ++r) {
+            int8_t *code = index.codes.data() + r * index.stride;
+            index.encode(store.row(r), code);
+            float s = 0.0f;
+            for (size_t d = 0; d < dim; ++d) {
+                float x = index.scale[d] * code[d];
+                s += x * x;
+            }
+            index.codeNormSq[r] = s;
+        }
+    });
+    return index;
+}
+
+/**
+ * @brief k-NN search over int8 codes.
+ *
+ * The query stays in floats and is compared with each decoded row x̂:
+ * with u = query - center and w[d] = scale[d]·u[d],
+ * |u - scale·code|² = |u|² + codeNormSq - 2·w·code. The weights w are
+ * rounded to 16 bits once per query, so every row costs one integer dot
+ * product with dotInt16Int8 (VNNI where available), reading a quarter of
+ * the bytes of a float scan. With options.rerank > K, that many closest
+ * codes are re-ranked with exact distances to the stored vectors; otherwise
+ * the K closest codes are reported with their approximate distances.
+ *
+ * @param index The int8 index.
+ * @param query The query, Dim() contiguous floats.
+ * @param K Number of nearest neighbors to search for.
+ * @param ctx Caller-owned context; ctx.results receives the neighbors, valid until its next search.
+ * @param options Number of candidates to re-rank.
+ */
+template <typename T>
+void knnSearch(const Sq8Index<T> &index, const float *query, int K, SearchContext &ctx,
+               const SearchOptions &options = {})
+{
+    ctx.start(Embedding_T<T>::Dim());
+    const EmbeddingStore &store = *index.store;
+    size_t n = index.size();
+    size_t dim = index.center.size();
+
+    // 16-bit weights, scaled so that no 32-bit partial sum of the kernel overflows
+    float queryNormSq = 0.0f, widest = 0.0f;
+    ctx.weights.assign(index.stride, int16_t(0));
+    std::vector<float> &w = ctx.table;
+    w.resize(dim);
+    for (size_t d = 0; d < dim; ++d) {
+        float u = query[d] - index.center[d];
+        queryNormSq += u * u;
+        w[d] = index.scale[d] * u;
+        widest = std::max(widest, std::abs(w[d]));
+    }
+    float limit = static_cast<float>(std::min<size_t>(32767, INT32_MAX / (127 * index.stride)));
+    float step = widest > 0.0f ? widest / limit : 1.0f;
+    for (size_t d = 0; d < dim; ++d) {
+        ctx.weights[d] = static_cast<int16_t>(std::nearbyint(w[d] / step));
+    }
+    const int16_t *q = ctx.weights.data();
+    float twoStep = 2.0f * step;
+    bool rerank = options.rerank > static_cast<size_t>(K);
+
+    auto scan = [&](auto &top, auto label) {
+        for (size_t r = 0; r < n; ++r) {
+            float dot = static_cast<float>(dotInt16Int8(q, index.code(r), index.stride));
+            float d = std::max(0.0f, queryNormSq + index.codeNormSq[r] - twoStep * dot);
+            if (d <= top.worst()) {
+                top.offer(d, label(r));
+            }
+        }
+        ctx.checks += n;
+    };
+    auto search = [&](auto &top) {
+        top.reset(K);
+        if (rerank) {
+            ctx.beam.reset(static_cast<int>(options.rerank));
+            scan(ctx.beam, [](size_t r) { return static_cast<int>(r); });
+            withDistanceSq<T>(store, [&](auto dist) {
+                for (const PQItem &c : ctx.beam.sorted()) {
+                    top.offer(dist(query, c.second), store.id(c.second));
+                }
+            });
+        }
+        else {
+            scan(top, [&](size_t r) { return store.id(r); });
+        }
+        ctx.results = top.sorted();
+    };
+    if (K <= kSmallK) {
+        search(ctx.small);
+    }
+    else {
+        search(ctx.heap);
+    }
+}
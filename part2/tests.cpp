@@ -0,0 +1,338 @@
+#include "knn.hpp"
+#include "pq.hpp"
+#include <iostream>
+#include <fstream>
+#include <random>
+#include <unordered_map>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+using Row = std::vector<float>;
+
+// Number of failed checks so far
+int failures = 0;
+
+// Records a failed check unless ok.
+void check(bool ok, const std::string &what)
+{
+    if (!ok) {
+        std::cerr << "FAIL: " << what << "\n";
+        ++failures;
+    }
+}
+
+// Loads every passage of a bundled data file; sets the runtime dimension.
+std::vector<std::pair<Row, int>> loadItems(const std::string &path, size_t dim)
+{
+    runtime_dim() = dim;
+    std::ifstream ifs(path);
+    json passages_json;
+    ifs >> passages_json;
+    std::vector<std::pair<Row, int>> items;
+    for (const auto &elem : passages_json) {
+        Row row(dim);
+        readEmbedding(elem["embedding"], row.data(), dim);
+        items.emplace_back(row, elem["id"].get<int>());
+    }
+    return items;
+}
+
+// n points of dim coordinates drawn from {0, ..., levels - 1}, so most coordinates are tied.
+std::vector<std::pair<Row, int>> tiedItems(size_t n, size_t dim, int levels, unsigned seed)
+{
+    runtime_dim() = dim;
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int> level(0, levels - 1);
+    std::vector<std::pair<Row, int>> items;
+    for (size_t i = 0; i < n; ++i) {
+        Row row(dim);
+        for (float &x : row) x = static_cast<float>(level(rng));
+        items.emplace_back(row, static_cast<int>(i));
+    }
+    return items;
+}
+
+// n points of dim normal coordinates rounded to multiples of 1/8, so a few are tied.
+std::vector<std::pair<Row, int>> randomItems(size_t n, size_t dim, unsigned seed)
+{
+    runtime_dim() = dim;
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> coordinate;
+    std::vector<std::pair<Row, int>> items;
+    for (size_t i = 0; i < n; ++i) {
+        Row row(dim);
+        for (float &x : row) x = std::round(coordinate(rng) * 8.0f) / 8.0f;
+        items.emplace_back(row, static_cast<int>(i));
+    }
+    return items;
+}
+
+// The original builder: sorts every range on its split coordinate and recurses on
+// copies of the halves; ranges of at most leafSize points become one leaf. Appends
+// the nodes of the tree in preorder, each as its ids: one for an inner node, the
+// sorted ids of its bucket for a leaf.
+void sortingBuild(std::vector<std::pair<Row, int>> items, int depth, size_t dim, size_t leafSize,
+                  std::vector<std::vector<int>> &preorder)
+{
+    if (items.empty()) return;
+    if (items.size() <= leafSize) {
+        std::vector<int> bucket;
+        for (const auto &item : items) bucket.push_back(item.second);
+        std::sort(bucket.begin(), bucket.end());
+        preorder.push_back(bucket);
+        return;
+    }
+    int axis = depth % static_cast<int>(dim);
+    std::sort(items.begin(), items.end(),
+              [&axis](auto &a, auto &b) { return a.first[axis] < b.first[axis]; });
+    int medianIndex = (static_cast<int>(items.size()) - 1) / 2;
+    preorder.push_back({items[medianIndex].second});
+    sortingBuild(std::vector(items.begin(), items.begin() + medianIndex), depth + 1, dim, leafSize, preorder);
+    sortingBuild(std::vector(items.begin() + medianIndex + 1, items.end()), depth + 1, dim, leafSize, preorder);
+}
+
+// buildKDTree must give the sorting builder's tree, ties included, for any thread
+// count, and with leaf buckets also the same row order for every thread count.
+void testTreeShape(const std::string &name, const std::vector<std::pair<Row, int>> &items, size_t dim,
+                   size_t leafSize = 1)
+{
+    std::vector<std::vector<int>> expected;
+    sortingBuild(items, 0, dim, leafSize, expected);
+    std::vector<int> serialOrder;
+    for (unsigned threads : {1u, 4u}) {
+        EmbeddingStore store(dim);
+        for (const auto &[row, id] : items) {
+            std::copy(row.begin(), row.end(), store.append(id));
+        }
+        BuildOptions options;
+        options.threads = threads;
+        options.serialCutoff = 64;
+        options.leafSize = leafSize;
+        KDTree<Row> tree = buildKDTree<Row>(store, options);
+        std::vector<std::vector<int>> got;
+        for (const KDNode &node : tree.nodes) {
+            std::vector<int> ids;
+            for (int32_t r = node.row; r < node.row + node.count; ++r) {
+                ids.push_back(store.id(r));
+            }
+            std::sort(ids.begin(), ids.end());
+            got.push_back(ids);
+        }
+        std::vector<int> order;
+        for (size_t r = 0; r < store.size(); ++r) order.push_back(store.id(r));
+        if (threads == 1) serialOrder = order;
+        std::string what = name + " with leaf size " + std::to_string(leafSize) + " and " +
+                           std::to_string(threads) + " threads";
+        check(got == expected, "tree shape of " + what);
+        check(order == serialOrder, "row order of " + what);
+    }
+}
+
+// Product quantization must train on any dataset, however few distinct
+// subvectors it has, and with every code re-ranked find the exact neighbors.
+void testPq(const std::string &name, const std::vector<std::pair<Row, int>> &items, size_t dim)
+{
+    EmbeddingStore store(dim);
+    for (const auto &[row, id] : items) {
+        std::copy(row.begin(), row.end(), store.append(id));
+    }
+    int K = static_cast<int>(std::min<size_t>(5, store.size()));
+    for (size_t m : {size_t(1), size_t(2), dim}) {
+        PqOptions options;
+        options.m = m;
+        PqIndex<Row> index;
+        try {
+            index = buildPq<Row>(store, options);
+        }
+        catch (const std::exception &e) {
+            check(false, "PQ training on " + name + " with m " + std::to_string(m) + ": " + e.what());
+            continue;
+        }
+        SearchOptions search;
+        search.rerank = store.size() + 1;
+        SearchContext ctx;
+        for (size_t q = 0; q < store.size(); ++q) {
+            std::vector<PQItem> expected;
+            for (size_t r = 0; r < store.size(); ++r) {
+                expected.push_back({Embedding_T<Row>::distance_sq(store.row(q), store.row(r)), store.id(r)});
+            }
+            std::sort(expected.begin(), expected.end());
+            expected.resize(K);
+            knnSearch(index, store.row(q), K, ctx, search);
+            std::vector<PQItem> got(ctx.results.begin(), ctx.results.end());
+            check(got == expected, "PQ search of " + name + " with m " + std::to_string(m) +
+                                   ", query " + std::to_string(q));
+        }
+    }
+}
+
+// On a half-precision store the k-d tree, built from the fp32 rows, must still
+// find exactly the nearest rounded rows.
+void testHalfStorage(const std::string &name, const std::vector<std::pair<Row, int>> &items, size_t dim)
+{
+    for (Storage storage : {Storage::F16, Storage::BF16}) {
+        EmbeddingStore store(dim);
+        for (const auto &[row, id] : items) {
+            std::copy(row.begin(), row.end(), store.append(id));
+        }
+        KDTree<Row> tree = buildKDTree<Row>(store);
+        store.toHalf(storage);
+        int K = static_cast<int>(std::min<size_t>(5, store.size()));
+        SearchContext ctx;
+        for (size_t q = 0; q < items.size(); q += 7) {
+            const float *query = items[q].first.data();
+            std::vector<PQItem> expected;
+            withDistanceSq<Row>(store, [&](auto dist) {
+                for (size_t r = 0; r < store.size(); ++r) {
+                    expected.push_back({dist(query, r), store.id(r)});
+                }
+            });
+            std::sort(expected.begin(), expected.end());
+            expected.resize(K);
+            knnSearch(tree, query, K, ctx);
+            std::vector<PQItem> got(ctx.results.begin(), ctx.results.end());
+            check(got == expected, "k-d tree search of " + name + " on " +
+                                   (storage == Storage::F16 ? "fp16" : "bf16") + ", query " + std::to_string(q));
+        }
+    }
+}
+
+// knnSearchIterative must give the recursive search's results after visiting as
+// many nodes, for embedding type T (Row or a fixed-size array). knnSearch itself
+// takes the iterative path for the arrays with a dispatched kernel, so the
+// recursion is called directly.
+template <typename T>
+void testIterativeSearch(const std::string &name, const std::vector<std::pair<Row, int>> &items, size_t dim)
+{
+    std::mt19937 rng(7);
+    std::normal_distribution<float> coordinate;
+    for (size_t leafSize : {size_t(1), size_t(8)}) {
+        EmbeddingStore store(dim);
+        for (const auto &[row, id] : items) {
+            std::copy(row.begin(), row.end(), store.append(id));
+        }
+        BuildOptions build;
+        build.leafSize = leafSize;
+        KDTree<T> tree = buildKDTree<T>(store, build);
+        SearchContext ctx;
+        for (int q = 0; q < 50; ++q) {
+            Row query(dim);
+            for (float &x : query) x = std::round(coordinate(rng) * 8.0f) / 8.0f;
+            for (int K : {1, 5, 40}) {
+                for (float eps : {0.0f, 0.5f}) {
+                    SearchOptions options;
+                    options.eps = eps;
+                    ctx.start(dim);
+                    ctx.heap.reset(K);
+                    withDistanceSq<T>(store, [&](auto dist) {
+                        knnSearch(tree, tree.root(), 0, query.data(), 0.0f, ctx.offsets.data(),
+                                  options.pruneScale(), ctx.heap, ctx.nodesVisited, dist);
+                    });
+                    std::span<const PQItem> recursive = ctx.heap.sorted();
+                    std::vector<PQItem> expected(recursive.begin(), recursive.end());
+                    size_t visited = ctx.nodesVisited;
+                    knnSearchIterative(tree, query.data(), K, ctx, options);
+                    std::vector<PQItem> got(ctx.results.begin(), ctx.results.end());
+                    check(got == expected && ctx.nodesVisited == visited,
+                          "iterative search of " + name + " with leaf size " + std::to_string(leafSize) +
+                          ", query " + std::to_string(q) + ", K " + std::to_string(K) +
+                          ", eps " + std::to_string(eps));
+                }
+            }
+        }
+    }
+}
+
+// knnSearchBestBin must find exactly the brute-force neighbors without a budget.
+// With one it must stop within the budget, up to finishing a leaf bucket, and
+// still return K true distances.
+template <typename T>
+void testBestBin(const std::string &name, const std::vector<std::pair<Row, int>> &items, size_t dim)
+{
+    std::mt19937 rng(11);
+    std::normal_distribution<float> coordinate;
+    for (size_t leafSize : {size_t(1), size_t(8)}) {
+        EmbeddingStore store(dim);
+        for (const auto &[row, id] : items) {
+            std::copy(row.begin(), row.end(), store.append(id));
+        }
+        BuildOptions build;
+        build.leafSize = leafSize;
+        KDTree<T> tree = buildKDTree<T>(store, build);
+        SearchContext ctx;
+        for (int q = 0; q < 30; ++q) {
+            Row query(dim);
+            for (float &x : query) x = std::round(coordinate(rng) * 8.0f) / 8.0f;
+            std::vector<PQItem> all;
+            std::unordered_map<int, float> distance;
+            for (size_t r = 0; r < store.size(); ++r) {
+                float d = Embedding_T<T>::distance_sq(query.data(), store.row(r));
+                all.push_back({d, store.id(r)});
+                distance[store.id(r)] = d;
+            }
+            std::sort(all.begin(), all.end());
+            for (int K : {1, 5, 40}) {
+                std::vector<PQItem> expected(all.begin(), all.begin() + std::min<size_t>(K, all.size()));
+                std::string what = "best-bin-first search of " + name + " with leaf size " +
+                                   std::to_string(leafSize) + ", query " + std::to_string(q) +
+                                   ", K " + std::to_string(K);
+                for (size_t maxChecks : {size_t(0), store.size()}) {
+                    SearchOptions options;
+                    options.maxChecks = maxChecks;
+                    knnSearchBestBin(tree, query.data(), K, ctx, options);
+                    std::vector<PQItem> got(ctx.results.begin(), ctx.results.end());
+                    check(got == expected, what + ", budget " + std::to_string(maxChecks));
+                }
+                for (size_t maxChecks : {size_t(40), size_t(200)}) {
+                    SearchOptions options;
+                    options.maxChecks = maxChecks;
+                    knnSearchBestBin(tree, query.data(), K, ctx, options);
+                    bool ok = ctx.checks < maxChecks + leafSize && ctx.results.size() == expected.size() &&
+                              std::is_sorted(ctx.results.begin(), ctx.results.end());
+                    for (const PQItem &item : ctx.results) {
+                        ok = ok && distance.count(item.second) && distance[item.second] == item.first;
+                    }
+                    check(ok, what + ", budget " + std::to_string(maxChecks) + " (" +
+                              std::to_string(ctx.checks) + " checks)");
+                }
+            }
+        }
+    }
+}
+
+int main()
+{
+    const std::pair<const char *, size_t> bundled[] = {
+        {"data/2d-1.json", 2}, {"data/3d-1.json", 3}, {"data/3d-2.json", 3}, {"data/4d-1.json", 4},
+        {"data/4d-2.json", 4}, {"data/20d-1.json", 20}, {"data/20d-2.json", 20}, {"data/20d-3.json", 20},
+    };
+    for (const auto &[path, dim] : bundled) {
+        testTreeShape(path, loadItems(path, dim), dim);
+        testPq(path, loadItems(path, dim), dim);
+        testHalfStorage(path, loadItems(path, dim), dim);
+    }
+    testTreeShape("tied 1-d", tiedItems(3000, 1, 20, 1), 1);
+    testTreeShape("tied 3-d", tiedItems(3000, 3, 4, 2), 3);
+    testTreeShape("tied 20-d", tiedItems(2000, 20, 2, 3), 20);
+    testTreeShape("all equal", tiedItems(500, 2, 1, 4), 2);
+    for (size_t leafSize : {size_t(4), size_t(16)}) {
+        testTreeShape("data/20d-3.json", loadItems("data/20d-3.json", 20), 20, leafSize);
+        testTreeShape("tied 3-d", tiedItems(3000, 3, 4, 2), 3, leafSize);
+        testTreeShape("random 20-d", randomItems(2000, 20, 5), 20, leafSize);
+    }
+    testPq("tied 3-d", tiedItems(3000, 3, 4, 2), 3);
+    testHalfStorage("tied 3-d", tiedItems(3000, 3, 4, 2), 3);
+    testIterativeSearch<Row>("random 20-d rows", randomItems(2000, 20, 5), 20);
+    testIterativeSearch<std::array<float, 20>>("random 20-d arrays", randomItems(2000, 20, 5), 20);
+    testIterativeSearch<Row>("tied 3-d", tiedItems(3000, 3, 4, 2), 3);
+    testBestBin<Row>("random 20-d rows", randomItems(2000, 20, 5), 20);
+    testBestBin<std::array<float, 20>>("random 20-d arrays", randomItems(2000, 20, 5), 20);
+    testBestBin<Row>("tied 3-d", tiedItems(3000, 3, 4, 2), 3);
+
+    if (failures > 0) {
+        std::cerr << failures << " check(s) failed\n";
+        return 1;
+    }
+    std::cout << "All tests passed\n";
+    return 0;
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief A fixed set of worker threads that run index ranges with work stealing.
+ *
+ * parallelFor cuts [0, n) into chunks of `grain` indices and deals each worker
+ * one contiguous block of chunks. A worker takes chunks from the front of its
+ * own block; once it runs dry it steals from the back of another worker's
+ * block, so uneven per-index cost (e.g. queries that visit many more tree
+ * nodes than others) does not leave threads idle. The calling thread works as
+ * worker 0, the other size() - 1 threads live as long as the pool.
+ */
+class WorkStealingPool
+{
+public:
+    explicit WorkStealingPool(unsigned threads)
+        : queues_(std::max(1u, threads))
+    {
+        for (unsigned w = 1; w < queues_.size(); ++w) {
+            workers_.emplace_back([this, w] { workerLoop(w); });
+        }
+    }
+
+    ~WorkStealingPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto &t : workers_) {
+            t.join();
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool &) = delete;
+    WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+    // Number of workers, including the calling thread
+    unsigned size() const { return static_cast<unsigned>(queues_.size()); }
+
+    /**
+     * @brief Calls fn(worker, begin, end) for chunks covering [0, n) and waits for all of them.
+     *
+     * `worker` is in [0, size()) and no two calls with the same worker run at
+     * once, so it can index per-worker scratch without locking.
+     * Not reentrant: fn must not call parallelFor on the same pool.
+     *
+     * @param n Number of indices.
+     * @param grain Indices per chunk, the unit of stealing.
+     * @param fn Callable taking (unsigned worker, size_t begin, size_t end).
+     */
+    template <typename Fn>
+    void parallelFor(size_t n, size_t grain, Fn &&fn)
+    {
+        if (n == 0) return;
+        grain = std::max<size_t>(1, grain);
+        size_t chunks = (n + grain - 1) / grain;
+
+        std::function<void(unsigned, size_t, size_t)> job = std::forward<Fn>(fn);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            job_ = &job;
+            pending_.store(chunks);
+            size_t W = queues_.size();
+            for (size_t w = 0; w < W; ++w) {
+                std::lock_guard<std::mutex> qlock(queues_[w].mutex);
+                for (size_t c = w * chunks / W; c < (w + 1) * chunks / W; ++c) {
+                    queues_[w].chunks.push_back({c * grain, std::min(n, (c + 1) * grain)});
+                }
+            }
+            ++generation_;
+        }
+        wake_.notify_all();
+
+        drain(0);
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [&] { return pending_.load() == 0; });
+        job_ = nullptr;
+    }
+
+private:
+    using Range = std::pair<size_t, size_t>;
+
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Range> chunks;
+    };
+
+    // Takes the next chunk of worker w's own block
+    bool pop(unsigned w, Range &r)
+    {
+        std::lock_guard<std::mutex> lock(queues_[w].mutex);
+        if (queues_[w].chunks.empty()) return false;
+        r = queues_[w].chunks.front();
+        queues_[w].chunks.pop_front();
+        return true;
+    }
+
+    // Takes the last chunk of the first non-empty block after worker w's
+    bool steal(unsigned w, Range &r)
+    {
+        for (unsigned i = 1; i < queues_.size(); ++i) {
+            Queue &victim = queues_[(w + i) % queues_.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.chunks.empty()) {
+                r = victim.chunks.back();
+                victim.chunks.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Runs chunks until no worker has any left
+    void drain(unsigned w)
+    {
+        Range r;
+        while (pop(w, r) || steal(w, r)) {
+            (*job_)(w, r.first, r.second);
+            if (pending_.fetch_sub(1) == 1) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                done_.notify_all();
+            }
+        }
+    }
+
+    void workerLoop(unsigned w)
+    {
+        uint64_t seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [&] { return stop_ || generation_ != seen; });
+                if (stop_) return;
+                seen = generation_;
+            }
+            drain(w);
+        }
+    }
+
+    std::vector<Queue> queues_;
+    std::vector<std::thread> workers_;
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    const std::function<void(unsigned, size_t, size_t)> *job_ = nullptr;
+    std::atomic<size_t> pending_{0};
+    uint64_t generation_ = 0;
+    bool stop_ = false;
+};